@@ -67,6 +67,18 @@ find_library(ALEMBIC_ABCGEOM_LIBRARY
 find_library(ALEMBIC_ABCCOREHDF5_LIBRARY
 	NAMES AlembicAbcCoreHDF5
 	PATHS ${LIBRARY_PATHS})
+
+find_library(ALEMBIC_ABCCOREOGAWA_LIBRARY
+	NAMES AlembicAbcCoreOgawa
+	PATHS ${LIBRARY_PATHS})
+
+find_library(ALEMBIC_ABCCOREFACTORY_LIBRARY
+	NAMES AlembicAbcCoreFactory
+	PATHS ${LIBRARY_PATHS})
+
+find_library(ALEMBIC_OGAWA_LIBRARY
+	NAMES AlembicOgawa
+	PATHS ${LIBRARY_PATHS})
 	
 find_library(ALEMBIC_ABCCOREABSTRACT_LIBRARY
 	NAMES AlembicAbcCoreAbstract
@@ -80,8 +92,11 @@ find_library(ALEMBIC_UTIL_LIBRARY
 set ( ALEMBIC_LIBRARIES
 	${ALEMBIC_ABC_LIBRARY}
 	${ALEMBIC_ABCGEOM_LIBRARY}
+	${ALEMBIC_ABCCOREFACTORY_LIBRARY}
+	${ALEMBIC_ABCCOREOGAWA_LIBRARY}
 	${ALEMBIC_ABCCOREHDF5_LIBRARY}
 	${ALEMBIC_ABCCOREABSTRACT_LIBRARY}
+	${ALEMBIC_OGAWA_LIBRARY}
 	${ALEMBIC_UTIL_LIBRARY}
 	)
 
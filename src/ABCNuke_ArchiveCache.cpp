@@ -0,0 +1,188 @@
+/*
+Copyright (c) 2011, Ivan Busquets
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+ * Neither the name of Ivan Busquets nor the names of its contributors may
+   be used to endorse or promote products derived from this software without
+   specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+//-*****************************************************************************
+#include "ABCNuke_ArchiveCache.h"
+#include "ABCNuke_SampleCache.h"
+#include "DDImage/Thread.h"
+
+// Alembic headers
+#include "Alembic/AbcCoreFactory/All.h"
+//-*****************************************************************************
+
+#include <cstdlib>
+#include <algorithm>
+#include <map>
+#include <sys/stat.h>
+
+using namespace Alembic::Abc;
+
+// Default number of Ogawa streams, when not set in the environment
+#define DEFAULT_OGAWA_STREAMS 4
+
+struct ArchiveEntry
+{
+	std::string filename;
+	Alembic::Util::weak_ptr<Alembic::AbcCoreAbstract::ArchiveReader> reader;
+	time_t mtime;
+	off_t size;
+};
+
+// Keyed by filename and read options
+typedef std::pair<std::string, std::pair<int, bool> > ArchiveKey;
+typedef std::map<ArchiveKey, ArchiveEntry> ArchiveMap;
+
+static ArchiveMap s_archives;
+static DD::Image::Lock s_archivesLock;
+
+// Modification time and size of every file we've opened, even if it's been
+// released since, so we know when cached samples from it are out of date
+typedef std::map<std::string, std::pair<time_t, off_t> > FileVersionMap;
+static FileVersionMap s_fileVersions;
+
+//-*****************************************************************************
+
+static bool statFile(const std::string& filename, time_t& mtime, off_t& size)
+{
+	struct stat st;
+	if (stat(filename.c_str(), &st) != 0)
+		return false;
+
+	mtime = st.st_mtime;
+	size = st.st_size;
+	return true;
+}
+
+//-*****************************************************************************
+
+// Drop entries whose archive has been released by every node
+static void purgeExpired()
+{
+	ArchiveMap::iterator it = s_archives.begin();
+	while (it != s_archives.end()) {
+		if (it->second.reader.expired()) {
+			s_archives.erase(it++);
+		}
+		else {
+			++it;
+		}
+	}
+}
+
+ArchiveReadOptions::ArchiveReadOptions()
+{
+	numStreams = DEFAULT_OGAWA_STREAMS;
+	useMmap = true;
+
+	const char* streams = getenv("ABCNUKE_OGAWA_STREAMS");
+	if (streams && atoi(streams) > 0) {
+		numStreams = atoi(streams);
+	}
+
+	const char* mmap = getenv("ABCNUKE_OGAWA_MMAP");
+	if (mmap && mmap[0] != '\0') {
+		useMmap = atoi(mmap) != 0;
+	}
+}
+
+//-*****************************************************************************
+
+IArchive getCachedArchive(const std::string& filename, const ArchiveReadOptions& options)
+{
+	time_t mtime = 0;
+	off_t size = 0;
+	if (filename.empty() || !statFile(filename, mtime, size))
+		return IArchive();
+
+	const ArchiveKey key(filename, std::make_pair(std::max(options.numStreams, 1), options.useMmap));
+
+	DD::Image::Guard guard(s_archivesLock);
+
+	ArchiveMap::iterator it = s_archives.find(key);
+	if (it != s_archives.end()) {
+		Alembic::AbcCoreAbstract::ArchiveReaderPtr reader = it->second.reader.lock();
+		if (reader && it->second.mtime == mtime && it->second.size == size) {
+			return IArchive(reader, kWrapExisting);
+		}
+		// File changed on disk (or nobody holds it anymore). Open it again.
+		s_archives.erase(it);
+	}
+
+	purgeExpired();
+
+	// Forget about anything we read from an older version of the file
+	FileVersionMap::iterator version = s_fileVersions.find(filename);
+	if (version != s_fileVersions.end() && version->second != std::make_pair(mtime, size)) {
+		clearCachedSamples(filename);
+	}
+	s_fileVersions[filename] = std::make_pair(mtime, size);
+
+	// Let the factory figure out the format. It tries Ogawa first,
+	// and falls back to HDF5.
+	Alembic::AbcCoreFactory::IFactory factory;
+	factory.setPolicy(ErrorHandler::kQuietNoopPolicy);
+	factory.setOgawaNumStreams(key.second.first);
+	factory.setOgawaReadStrategy(options.useMmap ?
+			Alembic::AbcCoreFactory::IFactory::kMemoryMappedFiles :
+			Alembic::AbcCoreFactory::IFactory::kFileStreams);
+
+	Alembic::AbcCoreFactory::IFactory::CoreType coreType;
+	IArchive archive = factory.getArchive(filename, coreType);
+
+	if (!archive.valid())
+		return archive;
+
+	ArchiveEntry entry;
+	entry.filename = filename;
+	entry.reader = archive.getPtr();
+	entry.mtime = mtime;
+	entry.size = size;
+	s_archives[key] = entry;
+
+	return archive;
+}
+
+//-*****************************************************************************
+
+void releaseCachedArchive(const std::string& filename)
+{
+	clearCachedSamples(filename);
+
+	DD::Image::Guard guard(s_archivesLock);
+
+	ArchiveMap::iterator it = s_archives.begin();
+	while (it != s_archives.end()) {
+		if (it->second.filename == filename) {
+			s_archives.erase(it++);
+		}
+		else {
+			++it;
+		}
+	}
+}
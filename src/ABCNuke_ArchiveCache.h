@@ -0,0 +1,64 @@
+/*
+Copyright (c) 2011, Ivan Busquets
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+ * Neither the name of Ivan Busquets nor the names of its contributors may
+   be used to endorse or promote products derived from this software without
+   specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _ABCNuke_ArchiveCache_h_
+#define _ABCNuke_ArchiveCache_h_
+
+//-*****************************************************************************
+#include <Alembic/Abc/All.h>
+//-*****************************************************************************
+
+#include <string>
+
+using namespace Alembic::Abc;
+
+// Ogawa read settings. The defaults can be set with the ABCNUKE_OGAWA_STREAMS
+// (number of streams) and ABCNUKE_OGAWA_MMAP (0 or 1) environment variables.
+struct ArchiveReadOptions
+{
+	ArchiveReadOptions();
+
+	int numStreams;     // Concurrent read streams for Ogawa archives
+	bool useMmap;       // Memory map Ogawa archives instead of pread-ing them
+};
+
+// Get an open archive for the given file.
+// The format (Ogawa or HDF5) is detected by the Alembic factory.
+// Archives are shared by every ABCReadGeo in the process: the registry keeps a
+// weak reference keyed by path and read options, and each node holds on to the
+// IArchive it gets back, so the file stays open for as long as someone is using it.
+// If the file's modification time or size changed since it was opened, the
+// stale entry is dropped and the archive is opened again.
+IArchive getCachedArchive(const std::string& filename,
+		const ArchiveReadOptions& options = ArchiveReadOptions());
+
+// Forget about a file, so the next getCachedArchive() call opens it again.
+void releaseCachedArchive(const std::string& filename);
+
+#endif
@@ -29,32 +29,12 @@ POSSIBILITY OF SUCH DAMAGE.
 
 //-*****************************************************************************
 #include "ABCNuke_ArchiveHelper.h"
+
+#include <cmath>
 //-*****************************************************************************
 
 using namespace Alembic::AbcGeom;
 
-void getABCGeos(Alembic::Abc::IObject & iObj,
-		std::vector<Alembic::AbcGeom::IObject> & _objs)
-{
-
-	unsigned int numChildren = iObj.getNumChildren();
-
-	for (unsigned i=0; i<numChildren; ++i)
-	{
-		IObject child( iObj.getChild( i ));
-		if ( Alembic::AbcGeom::IPolyMesh::matches(child.getHeader())
-		|| Alembic::AbcGeom::ISubD::matches(child.getHeader())) {
-			_objs.push_back(child);
-		}
-
-		if (child.getNumChildren() > 0) {
-			getABCGeos(child, _objs);
-		}
-	}
-}
-
-//-*****************************************************************************
-
 void getABCXforms(Alembic::Abc::IObject & iObj,
 		std::vector<Alembic::AbcGeom::IXform> & _objs)
 {
@@ -279,3 +259,36 @@ void getABCTimeSpan(IArchive archive, chrono_t& first, chrono_t& last)
 
 }
 //-*****************************************************************************
+double getABCFrameRate(IArchive archive, double defaultFps)
+{
+	if (!archive.valid())
+		return defaultFps;
+
+	// Sub-frame or every-other-frame samplings have steps that aren't frames,
+	// so only trust rates footage is actually shot at.
+	static const double frameRates[] = {23.976, 24, 25, 29.97, 30, 50, 59.94, 60};
+	static const unsigned numFrameRates = sizeof(frameRates) / sizeof(frameRates[0]);
+
+	// Time sampling 0 is the default one, with a sample per second.
+	// Of the others, the coarsest one is the most likely to step a whole frame.
+	double fps = 0;
+	for (uint32_t i = 1; i < archive.getNumTimeSamplings(); i++) {
+		TimeSamplingPtr ts = archive.getTimeSampling(i);
+		const TimeSamplingType& type = ts->getTimeSamplingType();
+		if (type.isAcyclic())
+			continue;
+
+		chrono_t timePerCycle = type.getTimePerCycle();
+		if (timePerCycle > 0 && (fps == 0 || 1.0 / timePerCycle < fps)) {
+			fps = 1.0 / timePerCycle;
+		}
+	}
+
+	for (unsigned i = 0; i < numFrameRates; i++) {
+		if (std::abs(fps - frameRates[i]) < 0.01)
+			return frameRates[i];
+	}
+
+	return defaultFps;
+}
+//-*****************************************************************************
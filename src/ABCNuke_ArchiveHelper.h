@@ -37,10 +37,6 @@ POSSIBILITY OF SUCH DAMAGE.
 
 using namespace Alembic::AbcGeom;
 
-// Get a list of geometry objects - IPolyMeshes and ISubDs
-void getABCGeos(Alembic::Abc::IObject & iObj,
-				std::vector<Alembic::AbcGeom::IObject> & _objs);
-
 // Get a list of IXforms
 void getABCXforms(Alembic::Abc::IObject & iObj,
 				std::vector<Alembic::AbcGeom::IXform> & _objs);
@@ -61,4 +57,8 @@ void getSubDTimeSpan(ISubD iSub, chrono_t& first, chrono_t& last);
 void getObjectTimeSpan(IObject obj, chrono_t& first, chrono_t& last, bool doChildren = false);
 void getABCTimeSpan(Alembic::Abc::IArchive archive, chrono_t& first, chrono_t& last);
 
+// Frame rate the archive was written at, from its uniform (or cyclic) time samplings.
+// Returns defaultFps unless one of them steps by the frame of a common frame rate.
+double getABCFrameRate(Alembic::Abc::IArchive archive, double defaultFps);
+
 #endif
@@ -31,171 +31,405 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "ABCNuke_GeoHelper.h"
 #include "ABCNuke_MatrixHelper.h"
 #include "ABCNuke_Interpolation.h"
+#include "ABCNuke_PointKernel.h"
+#include "ABCNuke_SampleCache.h"
+#include "ABCNuke_ThreadHelper.h"
 #include "DDImage/GeometryList.h"
+#include "DDImage/Thread.h"
 
 // Alembic headers
-#include "Alembic/AbcCoreHDF5/All.h"
 #include "Alembic/AbcGeom/All.h"
 //-*****************************************************************************
 
+#include <cstring>
+#include <map>
+
 using namespace DD::Image;
 using namespace Alembic::AbcGeom;
 
+// Meshes with fewer points (or face-vertices) than this are converted on a single thread
+#define PARALLEL_MIN_ELEMENTS 100000
 
-void writePoints(Alembic::AbcGeom::IPolyMesh iPoly, PointList& points, chrono_t curTime = 0, bool interpolate = false) {
+// Number of points handed to each thread at a time, for bigger meshes
+#define PARALLEL_GRAIN 32768
 
-	IPolyMeshSchema mesh = iPoly.getSchema();
-	TimeSamplingPtr ts = mesh.getTimeSampling();
+//-*****************************************************************************
 
-	IPolyMeshSchema::Sample mesh_samp;
-	const ISampleSelector iss(curTime);
-	mesh.get( mesh_samp, iss );
+// Transform (and optionally lerp) a range of points with the batch kernels
+struct TransformJob
+{
+	const float* start;
+	const float* end;       // NULL when not interpolating
+	float amt;
+	float* dst;
+	const float* matrix;
+	bool velocity;          // end holds velocities, and amt the time to move them along
+	bool normalize;         // for normals
+};
+
+static void transformPointRange(size_t begin, size_t end, void* d)
+{
+	TransformJob* job = (TransformJob*)d;
 
-	IObject iObj = mesh.getObject();
-	Matrix4 xform = getConcatMatrix( iObj, curTime, interpolate );
+	if (job->end && job->velocity) {
+		velocityTransformPoints(job->start + begin * 3, job->end + begin * 3, job->amt,
+				job->dst + begin * 3, end - begin, job->matrix);
+	}
+	else if (job->end) {
+		lerpTransformPoints(job->start + begin * 3, job->end + begin * 3, job->amt,
+				job->dst + begin * 3, end - begin, job->matrix);
+	}
+	else {
+		transformPoints(job->start + begin * 3, job->dst + begin * 3, end - begin, job->matrix);
+	}
 
-	Vector3 pos;
+	if (job->normalize) {
+		normalizeVectors(job->dst + begin * 3, end - begin);
+	}
+}
 
-	unsigned numPoints =  mesh_samp.getPositions()->size();
+static void transformPointsParallel(const float* start, const float* end, float amt,
+		float* dst, size_t numPoints, const float* matrix, unsigned numThreads,
+		bool normalize = false, bool velocity = false)
+{
+	TransformJob job;
+	job.start = start;
+	job.end = end;
+	job.amt = amt;
+	job.dst = dst;
+	job.matrix = matrix;
+	job.normalize = normalize;
+	job.velocity = velocity;
+
+	size_t grain = numPoints < PARALLEL_MIN_ELEMENTS ? numPoints : PARALLEL_GRAIN;
+	parallelFor(numPoints, grain, numThreads, transformPointRange, &job);
+}
 
-	points.resize(numPoints);
+//-*****************************************************************************
 
 
-	Alembic::AbcCoreAbstract::index_t floorIdx = 0;
-	Alembic::AbcCoreAbstract::index_t ceilIdx = 0;
-	double amt = 0;
+void ConstantPointCache::setArchive(Alembic::AbcCoreAbstract::ArchiveReaderPtr archive)
+{
+	Guard guard(m_lock);
+	if (m_archive.lock() != archive) {
+		m_positions.clear();
+		m_archive = archive;
+	}
+}
 
-	if (interpolate) {  // check if interpolation is really needed
+P3fArraySamplePtr ConstantPointCache::getPositions(IP3fArrayProperty P)
+{
+	const std::string path = getSampleKey(P, 0).property;
+	{
+		Guard guard(m_lock);
+		std::map<std::string, P3fArraySamplePtr>::const_iterator it = m_positions.find(path);
+		if (it != m_positions.end())
+			return it->second;
+	}
 
-		amt = getWeightAndIndex(curTime, ts,
-				mesh.getNumSamples(), floorIdx, ceilIdx);
+	P3fArraySamplePtr positions = getCachedSample(P, 0);
 
-		if (amt == 0 || floorIdx == ceilIdx) {
-			interpolate = false;
-		}
+	Guard guard(m_lock);
+	m_positions[path] = positions;
+	return positions;
+}
+
+//-*****************************************************************************
+
+// Move the points of a sample along its velocities by dt, and transform them.
+// Returns false if there are no velocities that match the points.
+static bool writeVelocityPoints(IV3fArrayProperty V, P3fArraySamplePtr positions,
+		Alembic::AbcCoreAbstract::index_t index, chrono_t dt,
+		std::vector<Vector3>& points, const Matrix4& xform, unsigned numThreads)
+{
+	if (!V.valid() || V.getNumSamples() == 0)
+		return false;
+
+	V3fArraySamplePtr velocities = getCachedSample(V, index);
+	if (!velocities || velocities->size() != positions->size())
+		return false;
+
+	points.resize(positions->size());
+	if (!points.empty()) {
+		transformPointsParallel(&positions->get()[0].x, &velocities->get()[0].x, float(dt),
+				&points[0].x, points.size(), xform[0], numThreads, false, true);
 	}
+	return true;
+}
 
-	if (interpolate) {  // now get samples for interpolation
+//-*****************************************************************************
 
-		const ISampleSelector iss_start(floorIdx);
-		const ISampleSelector iss_end(ceilIdx);
+// Transform the points of a single sample
+static void writeSamplePoints(P3fArraySamplePtr positions, std::vector<Vector3>& points,
+		const Matrix4& xform, unsigned numThreads)
+{
+	if (!positions) {
+		points.clear();
+		return;
+	}
 
-		IPolyMeshSchema::Sample mesh_samp_start;
-		IPolyMeshSchema::Sample mesh_samp_end;
-		mesh.get( mesh_samp_start, iss_start );
-		mesh.get( mesh_samp_end, iss_end );
+	points.resize(positions->size());
+	if (!points.empty()) {
+		transformPointsParallel(&positions->get()[0].x, NULL, 0,
+				&points[0].x, points.size(), xform[0], numThreads);
+	}
+}
 
+//-*****************************************************************************
 
-		for (unsigned i = 0; i < numPoints; i++) {
+// Points of an IPolyMesh or ISubD. Only the positions property is read (and the
+// velocities, in velocity mode): the nearest sample, or just the two around curTime
+// when interpolating. Everything goes through the sample cache, so revisiting a
+// frame doesn't read them again.
+template <class SCHEMA>
+static void writeSchemaPoints(SCHEMA& mesh, std::vector<Vector3>& points, chrono_t curTime, bool interpolate,
+		unsigned numThreads, XformCache* xformCache, bool useVelocities, ConstantPointCache* constantPoints, bool bakeXforms)
+{
+	TimeSamplingPtr ts = mesh.getTimeSampling();
+	size_t numSamples = mesh.getNumSamples();
+	IP3fArrayProperty P = mesh.getPositionsProperty();
 
-			Imath::V3f p_start = mesh_samp_start.getPositions()->get()[i];
-			Imath::V3f p_end = mesh_samp_end.getPositions()->get()[i];
-			pos = lerp(Vector3(p_start.getValue()) , Vector3(p_end.getValue()), amt );
+	Matrix4 xform;
+	if (bakeXforms) {
+		xform = getConcatMatrix( mesh.getObject(), curTime, interpolate, xformCache );
+	}
+	else {
+		xform.makeIdentity();
+	}
 
-			points[i] = xform.transform(pos);
-		}
+	// Nothing to interpolate
+	if (P.isConstant()) {
+		P3fArraySamplePtr positions = constantPoints ? constantPoints->getPositions(P) : getCachedSample(P, 0);
+		writeSamplePoints(positions, points, xform, numThreads);
+		return;
+	}
 
+	// Lookups shared by all the objects in this cook, if there are any
+	const SampleTimeCache* sampleTimes = xformCache ? xformCache->getSampleTimes() : NULL;
+	Alembic::AbcCoreAbstract::index_t index = getNearestIndex(curTime, ts, numSamples, sampleTimes);
+
+	// Velocity mode: move the nearest sample along its velocities. This works for
+	// changing topologies too, and doesn't need the samples around curTime.
+	if (interpolate && useVelocities && numSamples > 0) {
+		chrono_t dt = curTime - ts->getSampleTime(index);
+		if (dt != 0) {
+			P3fArraySamplePtr positions = getCachedSample(P, index);
+			if (positions && writeVelocityPoints(mesh.getVelocitiesProperty(), positions, index, dt,
+					points, xform, numThreads)) {
+				return;
+			}
+		}
+		// No usable velocities. Interpolate instead.
 	}
 
-	else { //no interpolation needed
+	if (interpolate) {  // check if interpolation is really needed
 
-		// Add points
-		for (unsigned i = 0; i < numPoints; i++) {
-			Imath::V3f p = mesh_samp.getPositions()->get()[i];
-			pos = Vector3(p.x, p.y, p.z);
-			points[i] = xform.transform(pos);
+		Alembic::AbcCoreAbstract::index_t floorIdx = 0;
+		Alembic::AbcCoreAbstract::index_t ceilIdx = 0;
+		double amt = getWeightAndIndex(curTime, ts, numSamples, floorIdx, ceilIdx, sampleTimes);
+
+		if (amt != 0 && floorIdx != ceilIdx) {
+
+			// Adjacent frames share these, so they're usually in the cache already
+			P3fArraySamplePtr p_start = getCachedSample(P, floorIdx);
+			P3fArraySamplePtr p_end = getCachedSample(P, ceilIdx);
+
+			if (p_start && p_end && p_start->size() == p_end->size()) {
+				points.resize(p_start->size());
+				if (!points.empty()) {
+					transformPointsParallel(&p_start->get()[0].x, &p_end->get()[0].x, float(amt),
+							&points[0].x, points.size(), xform[0], numThreads);
+				}
+				return;
+			}
+
+			// Bracketing samples don't match. Fall back to the nearest sample,
+			// which is one of them, so it won't be read again.
 		}
 	}
 
+	writeSamplePoints(getCachedSample(P, index), points, xform, numThreads);
 }
 
 //-*****************************************************************************
 
-void writePoints(Alembic::AbcGeom::ISubD iSub, PointList& points, chrono_t curTime = 0, bool interpolate = false) {
+void writePoints(Alembic::AbcGeom::IPolyMesh iPoly, std::vector<Vector3>& points, chrono_t curTime = 0, bool interpolate = false, unsigned numThreads = 0, XformCache* xformCache = NULL, bool useVelocities = false, ConstantPointCache* constantPoints = NULL, bool bakeXforms = true) {
 
+	IPolyMeshSchema mesh = iPoly.getSchema();
+	writeSchemaPoints(mesh, points, curTime, interpolate, numThreads, xformCache, useVelocities, constantPoints, bakeXforms);
+}
+
+//-*****************************************************************************
+
+void writePoints(Alembic::AbcGeom::ISubD iSub, std::vector<Vector3>& points, chrono_t curTime = 0, bool interpolate = false, unsigned numThreads = 0, XformCache* xformCache = NULL, bool useVelocities = false, ConstantPointCache* constantPoints = NULL, bool bakeXforms = true) {
 
 	ISubDSchema mesh = iSub.getSchema();
-	TimeSamplingPtr ts = mesh.getTimeSampling();
-	ISubDSchema::Sample mesh_samp;
+	writeSchemaPoints(mesh, points, curTime, interpolate, numThreads, xformCache, useVelocities, constantPoints, bakeXforms);
+}
 
-	const ISampleSelector iss(curTime);
+//-*****************************************************************************
 
-	mesh.get( mesh_samp, iss );
+void writePoints(const Alembic::AbcGeom::IObject iObj, std::vector<Vector3>& points, chrono_t curTime = 0, bool interpolate = false, unsigned numThreads = 0, XformCache* xformCache = NULL, bool useVelocities = false, ConstantPointCache* constantPoints = NULL, bool bakeXforms = true) {
 
-	IObject iObj = mesh.getObject();
-	Matrix4 xform = getConcatMatrix( iObj, curTime, interpolate );
+	if (Alembic::AbcGeom::IPolyMesh::matches(iObj.getHeader())) {
 
-	Vector3 pos;
+		// Do PolyMesh
+		IPolyMesh iPoly(iObj, Alembic::Abc::kWrapExisting);
+		writePoints(iPoly, points, curTime, interpolate, numThreads, xformCache, useVelocities, constantPoints, bakeXforms);
+	}
 
-	unsigned numPoints =  mesh_samp.getPositions()->size();
-	points.resize(numPoints);
+	else if (Alembic::AbcGeom::ISubD::matches(iObj.getHeader())) {
 
+		// Do SubD
+		ISubD iSub(iObj, Alembic::Abc::kWrapExisting);
+		writePoints(iSub, points, curTime, interpolate, numThreads, xformCache, useVelocities, constantPoints, bakeXforms);
+	}
+}
 
+//-*****************************************************************************
 
-	Alembic::AbcCoreAbstract::index_t floorIdx = 0;
-	Alembic::AbcCoreAbstract::index_t ceilIdx = 0;
-	double amt = 0;
+static void appendKey(const Alembic::AbcCoreAbstract::ArraySampleKey& key, Hash& hash)
+{
+	hash.append(key.digest.d, sizeof(key.digest.d));
+	hash.append((double)key.numBytes);
+}
 
-	if (interpolate) {  // check if interpolation is really needed
+// Key of a sample, or its index if the archive has no key for it
+static void appendSampleKey(const IArrayProperty& prop, Alembic::AbcCoreAbstract::index_t index, Hash& hash)
+{
+	Alembic::AbcCoreAbstract::ArraySampleKey key;
+	if (prop.getKey(key, ISampleSelector(index))) {
+		appendKey(key, hash);
+	}
+	else {
+		hash.append((int)index);
+	}
+}
 
-		amt = getWeightAndIndex(curTime, ts,
-				mesh.getNumSamples(), floorIdx, ceilIdx);
+template <class SCHEMA>
+static void appendSchemaPointKeys(SCHEMA& mesh, chrono_t curTime, bool interpolate, bool useVelocities, Hash& hash,
+		const SampleTimeCache* sampleTimes)
+{
+	size_t numSamples = mesh.getNumSamples();
+	if (numSamples == 0)
+		return;
 
-		if (amt == 0 || floorIdx == ceilIdx) {
-			interpolate = false;
+	IP3fArrayProperty P = mesh.getPositionsProperty();
+	TimeSamplingPtr ts = mesh.getTimeSampling();
+	Alembic::AbcCoreAbstract::index_t index = getNearestIndex(curTime, ts, numSamples, sampleTimes);
+
+	if (P.isConstant()) {
+		appendSampleKey(P, 0, hash);
+		return;
+	}
+
+	appendSampleKey(P, index, hash);
+
+	if (!interpolate)
+		return;
+
+	// Same choices as writePoints. Velocities fall back to lerping, so both go in.
+	if (useVelocities) {
+		IV3fArrayProperty V = mesh.getVelocitiesProperty();
+		chrono_t dt = curTime - ts->getSampleTime(index);
+		if (dt != 0 && V.valid() && V.getNumSamples() > 0) {
+			appendSampleKey(V, std::min<Alembic::AbcCoreAbstract::index_t>(index, V.getNumSamples() - 1), hash);
+			hash.append(dt);
 		}
 	}
 
-	if (interpolate) {  // now get samples for interpolation
+	Alembic::AbcCoreAbstract::index_t floorIdx = 0;
+	Alembic::AbcCoreAbstract::index_t ceilIdx = 0;
+	double amt = getWeightAndIndex(curTime, ts, numSamples, floorIdx, ceilIdx, sampleTimes);
+	if (amt == 0 || floorIdx == ceilIdx)
+		return;
+
+	Alembic::AbcCoreAbstract::ArraySampleKey floorKey, ceilKey;
+	if (P.getKey(floorKey, ISampleSelector(floorIdx)) && P.getKey(ceilKey, ISampleSelector(ceilIdx))) {
+		if (floorKey == ceilKey)  // a hold, written as repeated samples. Lerping doesn't move anything.
+			return;
+		appendKey(floorKey, hash);
+		appendKey(ceilKey, hash);
+	}
+	else {
+		hash.append((int)floorIdx);
+		hash.append((int)ceilIdx);
+	}
+	hash.append(amt);
+}
+
+void appendPointKeys(const Alembic::AbcGeom::IObject iObj, chrono_t curTime, bool interpolate, bool useVelocities, Hash& hash,
+		const SampleTimeCache* sampleTimes)
+{
+	if (Alembic::AbcGeom::IPolyMesh::matches(iObj.getHeader())) {
+		IPolyMesh iPoly(iObj, Alembic::Abc::kWrapExisting);
+		IPolyMeshSchema mesh = iPoly.getSchema();
+		appendSchemaPointKeys(mesh, curTime, interpolate, useVelocities, hash, sampleTimes);
+	}
 
-		const ISampleSelector iss_start(floorIdx);
-		const ISampleSelector iss_end(ceilIdx);
+	else if (Alembic::AbcGeom::ISubD::matches(iObj.getHeader())) {
+		ISubD iSub(iObj, Alembic::Abc::kWrapExisting);
+		ISubDSchema mesh = iSub.getSchema();
+		appendSchemaPointKeys(mesh, curTime, interpolate, useVelocities, hash, sampleTimes);
+	}
+}
 
-		ISubDSchema::Sample mesh_samp_start;
-		ISubDSchema::Sample mesh_samp_end;
-		mesh.get( mesh_samp_start, iss_start );
-		mesh.get( mesh_samp_end, iss_end );
+//-*****************************************************************************
 
+template <class SCHEMA>
+static void prefetchSchemaSamples(SCHEMA& mesh, chrono_t curTime, bool interpolate, bool useVelocities)
+{
+	size_t numSamples = mesh.getNumSamples();
+	if (numSamples <= 1)  // constant, nothing to read ahead
+		return;
 
-		for (unsigned i = 0; i < numPoints; i++) {
+	TimeSamplingPtr ts = mesh.getTimeSampling();
+	const ISampleSelector iss(curTime);
+	Alembic::AbcCoreAbstract::index_t index = iss.getIndex(ts, numSamples);
 
-			Imath::V3f p_start = mesh_samp_start.getPositions()->get()[i];
-			Imath::V3f p_end = mesh_samp_end.getPositions()->get()[i];
-			pos = lerp(Vector3(p_start.getValue()) , Vector3(p_end.getValue()), amt );
+	if (mesh.getTopologyVariance() == kHeterogenousTopology) {
+		getCachedSample(mesh.getFaceCountsProperty(), index);
+		getCachedSample(mesh.getFaceIndicesProperty(), index);
+	}
 
-			points[i] = xform.transform(pos);
+	// Same positions as writePoints: the nearest one and its velocities in velocity mode,
+	// the two samples around curTime, or the nearest one
+	if (interpolate && useVelocities) {
+		IV3fArrayProperty V = mesh.getVelocitiesProperty();
+		if (curTime != ts->getSampleTime(index) && V.valid() && V.getNumSamples() > 0) {
+			getCachedSample(mesh.getPositionsProperty(), index);
+			getCachedSample(V, index);
+			return;
 		}
-
 	}
 
-	else { //no interpolation needed
+	if (interpolate) {
+		Alembic::AbcCoreAbstract::index_t floorIdx = 0;
+		Alembic::AbcCoreAbstract::index_t ceilIdx = 0;
+		double amt = getWeightAndIndex(curTime, ts, numSamples, floorIdx, ceilIdx);
 
-		// Add points
-		for (unsigned i = 0; i < numPoints; i++) {
-			Imath::V3f p = mesh_samp.getPositions()->get()[i];
-			pos = Vector3(p.x, p.y, p.z);
-			points[i] = xform.transform(pos);
+		if (amt != 0 && floorIdx != ceilIdx) {
+			getCachedSample(mesh.getPositionsProperty(), floorIdx);
+			getCachedSample(mesh.getPositionsProperty(), ceilIdx);
+			return;
 		}
 	}
 
+	getCachedSample(mesh.getPositionsProperty(), index);
 }
 
-//-*****************************************************************************
-
-void writePoints(const Alembic::AbcGeom::IObject iObj, PointList& points, chrono_t curTime = 0, bool interpolate = false) {
-
+void prefetchSamples(const Alembic::AbcGeom::IObject iObj, chrono_t curTime, bool interpolate, bool useVelocities)
+{
 	if (Alembic::AbcGeom::IPolyMesh::matches(iObj.getHeader())) {
-
-		// Do PolyMesh
 		IPolyMesh iPoly(iObj, Alembic::Abc::kWrapExisting);
-		writePoints(iPoly, points, curTime, interpolate);
+		IPolyMeshSchema mesh = iPoly.getSchema();
+		prefetchSchemaSamples(mesh, curTime, interpolate, useVelocities);
 	}
 
 	else if (Alembic::AbcGeom::ISubD::matches(iObj.getHeader())) {
-
-		// Do SubD
 		ISubD iSub(iObj, Alembic::Abc::kWrapExisting);
-		writePoints(iSub, points, curTime, interpolate);
+		ISubDSchema mesh = iSub.getSchema();
+		prefetchSchemaSamples(mesh, curTime, interpolate, useVelocities);
 	}
 }
 
@@ -206,31 +440,56 @@ void fillPrimitiveIndices(const Alembic::AbcGeom::IObject iObj,
 		Int32ArraySamplePtr& _fi,
 		chrono_t curTime = 0)
 {
+	const ISampleSelector iss(curTime);
+
 	if (Alembic::AbcGeom::IPolyMesh::matches(iObj.getHeader())) {
 		IPolyMesh iPoly(iObj, Alembic::Abc::kWrapExisting);
 		IPolyMeshSchema mesh = iPoly.getSchema();
 		TimeSamplingPtr ts = mesh.getTimeSampling();
-		IPolyMeshSchema::Sample mesh_samp;
-		const ISampleSelector iss(curTime);
-		mesh.get( mesh_samp, iss );
-		_fc = mesh_samp.getFaceCounts();
-		_fi = mesh_samp.getFaceIndices();
+		Alembic::AbcCoreAbstract::index_t index = iss.getIndex(ts, mesh.getNumSamples());
+		_fc = getCachedSample(mesh.getFaceCountsProperty(), index);
+		_fi = getCachedSample(mesh.getFaceIndicesProperty(), index);
 	}
 
 	else if (Alembic::AbcGeom::ISubD::matches(iObj.getHeader())) {
 		ISubD iSub(iObj, Alembic::Abc::kWrapExisting);
 		ISubDSchema mesh = iSub.getSchema();
 		TimeSamplingPtr ts = mesh.getTimeSampling();
-		ISubDSchema::Sample mesh_samp;
-		const ISampleSelector iss(curTime);
-
-		mesh.get( mesh_samp, iss );
-		_fc = mesh_samp.getFaceCounts();
-		_fi = mesh_samp.getFaceIndices();
+		Alembic::AbcCoreAbstract::index_t index = iss.getIndex(ts, mesh.getNumSamples());
+		_fc = getCachedSample(mesh.getFaceCountsProperty(), index);
+		_fi = getCachedSample(mesh.getFaceIndicesProperty(), index);
 	}
 }
 
 
+//-*****************************************************************************
+
+template <class SCHEMA>
+static size_t getSchemaPointCount(SCHEMA& mesh, chrono_t curTime)
+{
+	const ISampleSelector iss(curTime);
+	P3fArraySamplePtr positions = getCachedSample(mesh.getPositionsProperty(),
+			iss.getIndex(mesh.getTimeSampling(), mesh.getNumSamples()));
+	return positions ? positions->size() : 0;
+}
+
+size_t getPointCount(const Alembic::AbcGeom::IObject iObj, chrono_t curTime)
+{
+	if (Alembic::AbcGeom::IPolyMesh::matches(iObj.getHeader())) {
+		IPolyMesh iPoly(iObj, Alembic::Abc::kWrapExisting);
+		IPolyMeshSchema mesh = iPoly.getSchema();
+		return getSchemaPointCount(mesh, curTime);
+	}
+
+	else if (Alembic::AbcGeom::ISubD::matches(iObj.getHeader())) {
+		ISubD iSub(iObj, Alembic::Abc::kWrapExisting);
+		ISubDSchema mesh = iSub.getSchema();
+		return getSchemaPointCount(mesh, curTime);
+	}
+
+	return 0;
+}
+
 //-*****************************************************************************
 
 Alembic::AbcGeom::IV2fGeomParam getUVsParam(const Alembic::AbcGeom::IObject iObj)
@@ -264,130 +523,349 @@ Alembic::AbcGeom::IN3fGeomParam getNsParam(const Alembic::AbcGeom::IObject iObj)
 		nParam = mesh.getNormalsParam();
 	}
 
+	// SubDs don't have normals in their schema, but they can be written as an arbGeomParam
+	else if (Alembic::AbcGeom::ISubD::matches(iObj.getHeader())) {
+		ISubD iSub(iObj, Alembic::Abc::kWrapExisting);
+		ICompoundProperty arbGeomParams = iSub.getSchema().getArbGeomParams();
+		if (arbGeomParams.valid()) {
+			const PropertyHeader* header = arbGeomParams.getPropertyHeader("N");
+			if (header && IN3fGeomParam::matches(*header)) {
+				nParam = IN3fGeomParam(arbGeomParams, "N");
+			}
+		}
+	}
+
 	return nParam;
 
 }
 
 //-*****************************************************************************
 
-void setUVs(GeoInfo& obj,
-		Alembic::AbcGeom::IV2fGeomParam & iUVs,
-		Attribute* UV,
-		chrono_t curTime = 0)
+struct RemapEntry
 {
+	Alembic::Util::weak_ptr<Int32ArraySample> faceCounts;
+	FaceVertexRemapPtr remap;
+};
 
-	if (!iUVs.valid())
-		return;
+// Keyed by faceCounts sample. The weak reference tells a reused address apart
+// from the sample the table was built for.
+typedef std::map<const Int32ArraySample*, RemapEntry> RemapMap;
 
-	unsigned int numFaceVertices = 0;
-	unsigned int numPrimitives = obj.primitives();
-	for (unsigned p = 0; p < numPrimitives; p++) {
-		for (unsigned v = 0; v < obj.primitive(p)->vertices(); v++) {
-			numFaceVertices++;
-		}
-	}
+static RemapMap s_remaps;
+static size_t s_remapsPurgeSize = 16;  // purge stale tables once there are this many
+static Lock s_remapsLock;
 
-	unsigned int numPoints = obj.points();
+static FaceVertexRemapPtr buildFaceVertexRemap(const Int32ArraySample& faceCounts)
+{
+	const int32_t* counts = faceCounts.get();
+	const size_t numFaces = faceCounts.size();
 
-	Alembic::AbcGeom::IV2fGeomParam::Sample samp = iUVs.getIndexedValue();
+	size_t numFaceVertices = 0;
+	for (size_t i = 0; i < numFaces; i++) {
+		numFaceVertices += std::max(counts[i], 0);
+	}
 
-	Alembic::AbcGeom::V2fArraySamplePtr uvPtr = samp.getVals();
-	Alembic::Abc::UInt32ArraySamplePtr indexPtr = samp.getIndices();
+	FaceVertexRemap* remap = new FaceVertexRemap(numFaceVertices);
+	uint32_t* dst = numFaceVertices ? &(*remap)[0] : NULL;
 
-	if (numFaceVertices != indexPtr->size() &&  numPoints != indexPtr->size()) { // UVs size is not per-point or per vertex-per-face
-		return;
+	uint32_t faceStart = 0;
+	for (size_t i = 0; i < numFaces; i++) {
+		const int numVerts = std::max(counts[i], 0);
+		const uint32_t last = faceStart + numVerts - 1;  // to match the reversed winding order
+		for (int v = 0; v < numVerts; v++) {
+			*dst++ = last - v;
+		}
+		faceStart += numVerts;
 	}
 
+	return FaceVertexRemapPtr(remap);
+}
 
-	int uvIndex = 0;
+FaceVertexRemapPtr getFaceVertexRemap(Int32ArraySamplePtr faceCounts)
+{
+	if (!faceCounts)
+		return FaceVertexRemapPtr();
 
-	// per-primitive per-vertex
-	if (numFaceVertices == indexPtr->size())
 	{
-		UV->resize(numFaceVertices);
-		Vector4 _uv(0,0,0,1);
-
-		for (unsigned pIndex = 0; pIndex < numPrimitives; ++pIndex)
-		{
-			int numPrimitiveVertices = obj.primitive(pIndex)->vertices();
+		Guard guard(s_remapsLock);
+		RemapMap::iterator it = s_remaps.find(faceCounts.get());
+		if (it != s_remaps.end() && it->second.faceCounts.lock() == faceCounts) {
+			return it->second.remap;
+		}
+	}
 
-			if (numPrimitiveVertices == 0)
-				continue;
+	// Build it without holding up other objects. If two threads get here with
+	// the same topology, they build the same table and one of them wins.
+	FaceVertexRemapPtr remap = buildFaceVertexRemap(*faceCounts);
 
-			int startPoint = uvIndex + numPrimitiveVertices - 1;  // to match the reversed winding order
+	Guard guard(s_remapsLock);
 
-			for (int vertexIndex = 0; vertexIndex < numPrimitiveVertices; vertexIndex++)
-			{
-				V2f uv2 = (*uvPtr)[(*indexPtr)[startPoint - vertexIndex]];
-				_uv.x = uv2[0];
-				_uv.y = uv2[1];
-				UV->vector4(uvIndex++) = _uv;
+	// Drop tables for topologies nobody reads anymore, once the map has doubled
+	// since last time, so this stays cheap when every frame has a new topology
+	if (s_remaps.size() >= s_remapsPurgeSize) {
+		RemapMap::iterator it = s_remaps.begin();
+		while (it != s_remaps.end()) {
+			if (it->second.faceCounts.expired()) {
+				s_remaps.erase(it++);
+			}
+			else {
+				++it;
 			}
 		}
+		s_remapsPurgeSize = std::max(s_remaps.size() * 2, size_t(16));
 	}
 
+	RemapEntry& entry = s_remaps[faceCounts.get()];
+	entry.faceCounts = faceCounts;
+	entry.remap = remap;
+
+	return remap;
 }
 
 //-*****************************************************************************
 
-void setNormals(GeoInfo& obj,
-		Alembic::AbcGeom::IN3fGeomParam & Ns,
-		Attribute* N,
-		chrono_t curTime = 0)
+static inline void convertValue(const V2f& in, Vector4& out)
+{
+	out = Vector4(in[0], in[1], 0, 1);
+}
+
+static inline void convertValue(const V3f& in, Vector3& out)
+{
+	out = Vector3(in.x, in.y, in.z);
+}
+
+// Expand (optionally indexed) values to one value per face-vertex, through the remap
+// table, or to one value per point when there's no remap table
+template <class IN, class OUT>
+struct ExpandJob
+{
+	const uint32_t* remap;      // NULL for point values
+	const uint32_t* indices;    // NULL if values aren't indexed
+	const IN* vals;
+	OUT* out;
+};
+
+template <class IN, class OUT>
+static void expandValuesRange(size_t begin, size_t end, void* d)
+{
+	ExpandJob<IN, OUT>* job = (ExpandJob<IN, OUT>*)d;
+
+	const uint32_t* remap = job->remap;
+	const uint32_t* indices = job->indices;
+	const IN* vals = job->vals;
+	OUT* out = job->out;
+
+	if (remap && indices) {
+		for (size_t i = begin; i < end; ++i) {
+			convertValue(vals[indices[remap[i]]], out[i]);
+		}
+	}
+	else if (remap) {
+		for (size_t i = begin; i < end; ++i) {
+			convertValue(vals[remap[i]], out[i]);
+		}
+	}
+	else if (indices) {
+		for (size_t i = begin; i < end; ++i) {
+			convertValue(vals[indices[i]], out[i]);
+		}
+	}
+	else {
+		for (size_t i = begin; i < end; ++i) {
+			convertValue(vals[i], out[i]);
+		}
+	}
+}
+
+template <class IN, class OUT>
+static void expandValues(const uint32_t* remap,
+		size_t count,
+		const UInt32ArraySamplePtr indexPtr,
+		const IN* vals,
+		std::vector<OUT>& out,
+		unsigned numThreads)
 {
-	if (!Ns.valid())
+	out.resize(count);
+	if (count == 0) {
 		return;
+	}
+
+	ExpandJob<IN, OUT> job;
+	job.remap = remap;
+	job.indices = indexPtr ? indexPtr->get() : NULL;
+	job.vals = vals;
+	job.out = &out[0];
 
-	unsigned int numFaceVertices = 0;
-	unsigned int numPrimitives = obj.primitives();
-	unsigned int numPoints = obj.points();
+	// Split big meshes across threads
+	size_t grain = count < PARALLEL_MIN_ELEMENTS ? count : PARALLEL_GRAIN;
+	parallelFor(count, grain, numThreads, expandValuesRange<IN, OUT>, &job);
+}
+
+// Expand a geom param's values to the face-vertices or points of a mesh, depending on its scope.
+// perPoint is set to whether they went to the points.
+template <class IN, class OUT>
+static bool expandGeomParam(Int32ArraySamplePtr faceCounts,
+		size_t numPoints,
+		GeometryScope scope,
+		const UInt32ArraySamplePtr indexPtr,
+		const IN* vals,
+		size_t numVals,
+		std::vector<OUT>& out,
+		bool& perPoint,
+		unsigned numThreads)
+{
+	size_t numIndices = indexPtr ? indexPtr->size() : numVals;
 
-	for (unsigned p = 0; p < numPrimitives; p++) {
-		for (unsigned v = 0; v < obj.primitive(p)->vertices(); v++) {
-			numFaceVertices++;
+	// Per point values go straight to the points, without going through the topology
+	perPoint = (scope == kVertexScope || scope == kVaryingScope);
+	if (perPoint) {
+		if (numIndices != numPoints) {
+			return false;
 		}
+		expandValues(NULL, numPoints, indexPtr, vals, out, numThreads);
+		return true;
 	}
 
-	Alembic::AbcGeom::IN3fGeomParam::Sample samp = Ns.getIndexedValue();
+	FaceVertexRemapPtr remap = getFaceVertexRemap(faceCounts);
+	if (!remap) {
+		return false;
+	}
+	const size_t numFaceVertices = remap->size();
 
-	Alembic::AbcGeom::N3fArraySamplePtr nPtr = samp.getVals();
-	Alembic::Abc::UInt32ArraySamplePtr indexPtr = samp.getIndices();
+	// per-primitive per-vertex only
+	if (numFaceVertices != numIndices) {
+		return false;
+	}
 
-	if (numFaceVertices != indexPtr->size() &&  numPoints != indexPtr->size()) { // UVs size is not per-point or per vertex-per-face
-		return;
+	expandValues(numFaceVertices ? &(*remap)[0] : NULL, numFaceVertices, indexPtr, vals, out, numThreads);
+	return true;
+}
+
+//-*****************************************************************************
+
+// Values (and indices, if it has them) of a geom param, through the sample cache.
+// indices is left empty for non-indexed params.
+template <class PARAM>
+static void getCachedIndexedValue(PARAM& param,
+		Alembic::AbcCoreAbstract::index_t index,
+		typename PARAM::prop_type::sample_ptr_type& vals,
+		UInt32ArraySamplePtr& indices)
+{
+	vals = getCachedSample(param.getValueProperty(), index);
+
+	if (param.isIndexed()) {
+		indices = getCachedSample(param.getIndexProperty(), index);
+	}
+	else {
+		indices.reset();
 	}
+}
+
+//-*****************************************************************************
 
+bool setUVs(Int32ArraySamplePtr faceCounts,
+		size_t numPoints,
+		Alembic::AbcGeom::IV2fGeomParam & iUVs,
+		std::vector<Vector4>& UV,
+		bool& perPoint,
+		chrono_t curTime,
+		unsigned numThreads)
+{
+	perPoint = false;
 
-	int nIndex = 0;
+	if (!iUVs.valid() || !faceCounts)
+		return false;
 
+	Alembic::AbcGeom::V2fArraySamplePtr uvPtr;
+	Alembic::Abc::UInt32ArraySamplePtr indexPtr;
+	const ISampleSelector iss(curTime);
+	getCachedIndexedValue(iUVs, iss.getIndex(iUVs.getTimeSampling(), iUVs.getNumSamples()), uvPtr, indexPtr);
 
-	// per-primitive per-vertex
-	if (numFaceVertices == indexPtr->size())
-	{
+	if (!uvPtr)
+		return false;
 
-		N->resize(numFaceVertices);
-		for (unsigned pIndex = 0; pIndex < numPrimitives; ++pIndex)
-		{
-			int numPrimitiveVertices = obj.primitive(pIndex)->vertices();
+	return expandGeomParam(faceCounts, numPoints, iUVs.getScope(), indexPtr,
+			uvPtr->get(), uvPtr->size(), UV, perPoint, numThreads);
+}
 
-			if (numPrimitiveVertices == 0)
-				continue;
+//-*****************************************************************************
 
-			int startPoint = nIndex + numPrimitiveVertices - 1;  // to match the reversed winding order
+// True if two samples of an indexed param use the same indices,
+// so their values can be lerped one to one
+static bool sameIndices(const UInt32ArraySamplePtr a, const UInt32ArraySamplePtr b)
+{
+	if (!a || !b)
+		return !a && !b;
 
-			for (int vertexIndex = 0; vertexIndex < numPrimitiveVertices; vertexIndex++)
-			{
+	if (a == b)
+		return true;
 
-				V3f normal = (*nPtr)[(*indexPtr)[startPoint - vertexIndex]];
-				N->normal(nIndex++) = Vector3(normal.x, normal.y, normal.z);
-			}
-		}
+	return a->size() == b->size() &&
+			(a->size() == 0 || memcmp(a->get(), b->get(), a->size() * sizeof(uint32_t)) == 0);
+}
 
+//-*****************************************************************************
 
+bool setNormals(Int32ArraySamplePtr faceCounts,
+		size_t numPoints,
+		Alembic::AbcGeom::IN3fGeomParam & Ns,
+		std::vector<Vector3>& N,
+		bool& perPoint,
+		chrono_t curTime,
+		bool interpolate,
+		unsigned numThreads)
+{
+	perPoint = false;
 
-	}
+	if (!Ns.valid() || !faceCounts)
+		return false;
 
+	// Normals go through the sample cache, so each sample is only decoded once
+	TimeSamplingPtr ts = Ns.getTimeSampling();
+	size_t numSamples = Ns.getNumSamples();
+	const ISampleSelector iss(curTime);
 
+	Alembic::AbcGeom::N3fArraySamplePtr nPtr;
+	Alembic::Abc::UInt32ArraySamplePtr indexPtr;
+	getCachedIndexedValue(Ns, iss.getIndex(ts, numSamples), nPtr, indexPtr);
+
+	if (!nPtr)
+		return false;
+
+	const N3f* vals = nPtr->get();
+	std::vector<N3f> lerped;
+
+	if (interpolate && numSamples > 1) {
+		Alembic::AbcCoreAbstract::index_t floorIdx = 0;
+		Alembic::AbcCoreAbstract::index_t ceilIdx = 0;
+		double amt = getWeightAndIndex(curTime, ts, numSamples, floorIdx, ceilIdx);
+
+		if (amt != 0 && floorIdx != ceilIdx) {
+			Alembic::AbcGeom::N3fArraySamplePtr n_start, n_end;
+			Alembic::Abc::UInt32ArraySamplePtr i_start, i_end;
+			getCachedIndexedValue(Ns, floorIdx, n_start, i_start);
+			getCachedIndexedValue(Ns, ceilIdx, n_end, i_end);
+
+			// Only lerp normals that line up. Otherwise stick to the nearest sample.
+			if (n_start && n_end && n_start->size() == nPtr->size() && n_end->size() == nPtr->size()
+					&& sameIndices(i_start, indexPtr) && sameIndices(i_end, indexPtr)) {
+
+				// Same batch kernel as the points, with no transform, and renormalized
+				Matrix4 identity;
+				identity.makeIdentity();
+
+				lerped.resize(nPtr->size());
+				if (!lerped.empty()) {
+					transformPointsParallel(&n_start->get()[0].x, &n_end->get()[0].x, float(amt),
+							&lerped[0].x, lerped.size(), identity[0], numThreads, true);
+					vals = &lerped[0];
+				}
+			}
+		}
+	}
+
+	return expandGeomParam(faceCounts, numPoints, Ns.getScope(), indexPtr,
+			vals, nPtr->size(), N, perPoint, numThreads);
 }
 
 
@@ -442,13 +920,17 @@ bool isTopologyChanging(IObject iObj)
 
 //-*****************************************************************************
 
-bool isTopologyChanging(std::vector<Alembic::AbcGeom::IObject> _objs)
+// True if the UVs or normals we read from this object change over time
+bool isAttributeAnimated(IObject iObj)
 {
+	IV2fGeomParam uvParam = getUVsParam(iObj);
+	if (uvParam.valid() && !uvParam.isConstant()) {
+		return true;
+	}
 
-	for( std::vector<Alembic::AbcGeom::IObject>::const_iterator iObj( _objs.begin() ); iObj != _objs.end(); ++iObj ) {
-		if (isTopologyChanging(*iObj)) {
-			return true;
-		}
+	IN3fGeomParam nParam = getNsParam(iObj);
+	if (nParam.valid() && !nParam.isConstant()) {
+		return true;
 	}
 
 	return false;
@@ -481,22 +963,66 @@ void buildBboxPrimitives(GeometryList& out, unsigned obj)
 }
 
 //-*****************************************************************************
-void buildABCPrimitives(GeometryList& out, unsigned obj, const Alembic::AbcGeom::IObject iObj, chrono_t curTime)
+// Add all the faces of a mesh as one PolyMesh primitive.
+// Returns false, without adding anything, if the mesh has to be built from Polygons.
+static bool buildABCPolyMesh(GeometryList& out, unsigned obj, Int32ArraySamplePtr _fc, const std::vector<unsigned>& vertices)
+{
+	const int32_t* faceCounts = _fc->get();
+	const unsigned numFaces = _fc->size();
+
+	// PolyMesh faces need at least 3 vertices. Points and lines stay Polygons.
+	for (unsigned i = 0; i < numFaces; i++) {
+		if (faceCounts[i] < 3)
+			return false;
+	}
+
+	if (numFaces == 0)
+		return false;
+
+	PolyMesh* mesh = new PolyMesh(vertices.size(), numFaces);
+
+	size_t v_offset = 0;
+	for (unsigned i = 0; i < numFaces; i++) {
+		const int num_verts = faceCounts[i];
+		mesh->add_face(num_verts, const_cast<unsigned*>(&vertices[v_offset]));
+		v_offset += num_verts;
+	}
+
+	out.add_primitive(obj, mesh);
+	return true;
+}
+
+//-*****************************************************************************
+
+void buildABCPrimitives(GeometryList& out, unsigned obj, Int32ArraySamplePtr _fc, Int32ArraySamplePtr _fi, bool singleMesh)
 {
-	Int32ArraySamplePtr _fc;
-	Int32ArraySamplePtr _fi;
+	if (!_fc || !_fi)
+		return;
 
-	fillPrimitiveIndices(iObj, _fc, _fi, curTime);
+	FaceVertexRemapPtr remap = getFaceVertexRemap(_fc);
+	const size_t numFaceVerts = remap->size();
+	if (numFaceVerts > _fi->size())
+		return;
 
-	unsigned v_offset = 0;
+	// Point index of every face-vertex, already in Nuke's winding order
+	std::vector<unsigned> vertices(numFaceVerts);
+	const int32_t* faceIndices = _fi->get();
+	for (size_t i = 0; i < numFaceVerts; i++) {
+		vertices[i] = faceIndices[(*remap)[i]];
+	}
+
+	if (singleMesh && buildABCPolyMesh(out, obj, _fc, vertices))
+		return;
+
+	size_t v_offset = 0;
 	unsigned numPrimitives =_fc->size();
 	// Create primitives
 	for (unsigned i = 0; i < numPrimitives; i++) {
-		unsigned num_verts = _fc->get()[i];
+		int num_verts = std::max(_fc->get()[i], 0);
 		Primitive *prim = new Polygon(num_verts, true);
 
-		for (unsigned pv = 0; pv < num_verts; pv++) {
-			prim->vertex(pv) = (*_fi)[v_offset + num_verts - pv -1]; // inverted winding order
+		for (int pv = 0; pv < num_verts; pv++) {
+			prim->vertex(pv) = vertices[v_offset + pv];
 		}
 
 		// Add primitive to obj
@@ -509,6 +1035,70 @@ void buildABCPrimitives(GeometryList& out, unsigned obj, const Alembic::AbcGeom:
 
 //-*****************************************************************************
 
+void writeBboxPoints(const Alembic::AbcGeom::IObject iObj, std::vector<Vector3>& points, chrono_t curTime, bool interpolate, XformCache* xformCache, bool bakeXforms)
+{
+	Imath::Box3d bbox = getBounds(iObj, curTime);
+
+	points.resize(8);
+
+	IObject iObj_copy(iObj);
+	Matrix4 xf;
+	if (bakeXforms) {
+		xf = getConcatMatrix(iObj_copy,curTime, interpolate, xformCache); // for some reason getParent() won't take a const IObject, hence the copy...
+	}
+	else {
+		xf.makeIdentity();
+	}
+
+	// Add bbox corners
+	for (unsigned i = 0; i < 8; i++) {
+		Vector3 pt((i&4)>>2 ? bbox.max.x : bbox.min.x, (i&2)>>1 ? bbox.max.y : bbox.min.y, (i%2) ? bbox.max.z : bbox.min.z );
+		points[i] = xf.transform(pt);
+	}
+}
+
+//-*****************************************************************************
+
+void stageObject(const Alembic::AbcGeom::IObject iObj, ObjectStage& stage, unsigned mask,
+		bool bbox, chrono_t curTime, bool interpolate, unsigned numThreads, XformCache* xformCache,
+		bool useVelocities, ConstantPointCache* constantPoints, bool bakeXforms)
+{
+	// Parent transforms go on the object instead of the points
+	if (!bakeXforms) {
+		stage.matrix = getConcatMatrix(iObj, curTime, interpolate, xformCache);
+	}
+
+	if (bbox) {
+		if (mask & Mask_Points) {
+			writeBboxPoints(iObj, stage.points, curTime, interpolate, xformCache, bakeXforms);
+		}
+		return;
+	}
+
+	// Attributes are laid out per face-vertex, so they need the topology too
+	if (mask & (Mask_Primitives | Mask_Attributes)) {
+		fillPrimitiveIndices(iObj, stage.faceCounts, stage.faceIndices, curTime);
+	}
+
+	if (mask & Mask_Points) {
+		writePoints(iObj, stage.points, curTime, interpolate, numThreads, xformCache, useVelocities, constantPoints, bakeXforms);
+	}
+
+	if (mask & Mask_Attributes) {
+		// Point count, for params with one value per point
+		size_t numPoints = (mask & Mask_Points) ? stage.points.size() : getPointCount(iObj, curTime);
+
+		IV2fGeomParam uvParam = getUVsParam(iObj);
+		stage.hasUVs = setUVs(stage.faceCounts, numPoints, uvParam, stage.uvs, stage.uvsPerPoint, curTime, numThreads);
+
+		IN3fGeomParam nParam = getNsParam(iObj);
+		stage.hasNormalsParam = nParam.valid();
+		stage.hasNormals = setNormals(stage.faceCounts, numPoints, nParam, stage.normals, stage.normalsPerPoint, curTime, interpolate, numThreads);
+	}
+}
+
+//-*****************************************************************************
+
 
 
 
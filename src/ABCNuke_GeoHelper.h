@@ -33,10 +33,13 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "DDImage/Attribute.h"
 #include "DDImage/GeoInfo.h"
 #include "DDImage/GeometryList.h"
+#include "DDImage/Hash.h"
 #include "DDImage/Primitive.h"
 #include "DDImage/Polygon.h"
+#include "DDImage/PolyMesh.h"
 #include "DDImage/Point.h"
 #include "DDImage/Vector3.h"
+#include "DDImage/Vector4.h"
 #include "DDImage/Matrix4.h"
 #include "DDImage/DDMath.h"
 
@@ -44,8 +47,6 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "ABCNuke_Interpolation.h"
 #include "ABCNuke_MatrixHelper.h"
 
-#include <Alembic/AbcCoreHDF5/All.h>
-
 #include <ImathBoxAlgo.h>
 
 
@@ -53,16 +54,87 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <map>
+#include <vector>
 #include <unistd.h>
 
 using namespace DD::Image;
 using namespace Alembic::AbcGeom;
 
-void writePoints(Alembic::AbcGeom::IPolyMesh iPoly, PointList& points, chrono_t curTime, bool interpolate);
-
-void writePoints(Alembic::AbcGeom::ISubD iSub, PointList& points, chrono_t curTime, bool interpolate);
-
-void writePoints(const Alembic::AbcGeom::IObject iObj, PointList& points, chrono_t curTime, bool interpolate);
+// Geometry read from one Alembic object, waiting to be copied into the GeometryList.
+// Filling these in doesn't touch the GeometryList, so it can be done from several threads.
+struct ObjectStage
+{
+	ObjectStage() : hasUVs(false), uvsPerPoint(false), hasNormalsParam(false), hasNormals(false), normalsPerPoint(false) {
+		matrix.makeIdentity();
+	}
+
+	Int32ArraySamplePtr faceCounts;
+	Int32ArraySamplePtr faceIndices;
+	std::vector<Vector3> points;
+	bool hasUVs;            // uvs are valid
+	bool uvsPerPoint;       // uvs go to Group_Points instead of Group_Vertices
+	std::vector<Vector4> uvs;
+	bool hasNormalsParam;   // object has normals at all
+	bool hasNormals;        // normals are valid
+	bool normalsPerPoint;   // normals go to Group_Points instead of Group_Vertices
+	std::vector<Vector3> normals;
+	Matrix4 matrix;         // object to world, when transforms aren't baked into the points
+};
+
+// Alembic faces are wound the other way round from Nuke's. For every face-vertex
+// we output, this holds the face-vertex of the Alembic sample it comes from, so
+// point indices, UVs and normals can all be expanded with a single gather.
+typedef std::vector<uint32_t> FaceVertexRemap;
+typedef Alembic::Util::shared_ptr<const FaceVertexRemap> FaceVertexRemapPtr;
+
+// Get the remap table for a topology. Tables are built once, and kept for as long
+// as the faceCounts sample is alive (in the sample cache, or during a cook).
+FaceVertexRemapPtr getFaceVertexRemap(Int32ArraySamplePtr faceCounts);
+
+// Local positions of constant meshes, kept once read. Rigid objects under animated
+// xforms then only need their matrix worked out again on later frames, with no
+// Alembic reads and no trips through the sample cache (which could evict them).
+// Safe to use from several threads.
+class ConstantPointCache
+{
+public:
+	ConstantPointCache() {}
+
+	// Forget all positions if they came from a different archive
+	void setArchive(Alembic::AbcCoreAbstract::ArchiveReaderPtr archive);
+
+	// The only sample of a constant positions property
+	P3fArraySamplePtr getPositions(IP3fArrayProperty P);
+
+private:
+	Alembic::Util::weak_ptr<Alembic::AbcCoreAbstract::ArchiveReader> m_archive;
+	std::map<std::string, P3fArraySamplePtr> m_positions;  // keyed by property path
+	DD::Image::Lock m_lock;
+};
+
+// With interpolate and useVelocities, points are moved from the nearest sample along
+// the mesh's velocities, if it has them, instead of lerped between samples.
+// Constant meshes get their positions from constantPoints, if there is one.
+// Without bakeXforms, points are left in object space.
+void writePoints(Alembic::AbcGeom::IPolyMesh iPoly, std::vector<Vector3>& points, chrono_t curTime, bool interpolate, unsigned numThreads, XformCache* xformCache, bool useVelocities, ConstantPointCache* constantPoints, bool bakeXforms);
+
+void writePoints(Alembic::AbcGeom::ISubD iSub, std::vector<Vector3>& points, chrono_t curTime, bool interpolate, unsigned numThreads, XformCache* xformCache, bool useVelocities, ConstantPointCache* constantPoints, bool bakeXforms);
+
+void writePoints(const Alembic::AbcGeom::IObject iObj, std::vector<Vector3>& points, chrono_t curTime, bool interpolate, unsigned numThreads, XformCache* xformCache, bool useVelocities, ConstantPointCache* constantPoints, bool bakeXforms);
+
+void writeBboxPoints(const Alembic::AbcGeom::IObject iObj, std::vector<Vector3>& points, chrono_t curTime, bool interpolate, XformCache* xformCache, bool bakeXforms = true);
+
+// Add the keys (content digests) of the position samples writePoints would read at
+// curTime to hash. Times with the same keys give the same points, before transforms,
+// so long holds in "animated" meshes don't need their points rebuilt.
+// Samples are looked up in sampleTimes, if it's there.
+void appendPointKeys(const Alembic::AbcGeom::IObject iObj, chrono_t curTime, bool interpolate, bool useVelocities, Hash& hash,
+		const SampleTimeCache* sampleTimes = NULL);
+
+// Read the samples writePoints (and fillPrimitiveIndices, if the topology changes)
+// will need at curTime into the sample cache
+void prefetchSamples(const Alembic::AbcGeom::IObject iObj, chrono_t curTime, bool interpolate, bool useVelocities);
 
 void fillPrimitiveIndices(const Alembic::AbcGeom::IObject iObj, Int32ArraySamplePtr& _fc, Int32ArraySamplePtr& _fi, chrono_t curTime);
 
@@ -70,19 +142,36 @@ Alembic::AbcGeom::IV2fGeomParam getUVsParam(const Alembic::AbcGeom::IObject iObj
 
 Alembic::AbcGeom::IN3fGeomParam getNsParam(const Alembic::AbcGeom::IObject iObj);
 
-void setUVs(GeoInfo& obj, Alembic::AbcGeom::IV2fGeomParam & iUVs, Attribute* UV, chrono_t curTime);
+// Number of points of a mesh at curTime
+size_t getPointCount(const Alembic::AbcGeom::IObject iObj, chrono_t curTime);
+
+// Face-varying UVs and normals are expanded to one value per face-vertex. Vertex and
+// varying scoped ones are kept per point (numPoints of them), and perPoint is set.
+bool setUVs(Int32ArraySamplePtr faceCounts, size_t numPoints, Alembic::AbcGeom::IV2fGeomParam & iUVs, std::vector<Vector4>& UV, bool& perPoint, chrono_t curTime, unsigned numThreads);
 
-void setNormals(GeoInfo& obj, Alembic::AbcGeom::IN3fGeomParam & Ns, Attribute* N, chrono_t curTime);
+// Normals are read at curTime, and lerped (and renormalized) between the samples around it
+// when interpolating. SubD normals come from an "N" arbGeomParam.
+bool setNormals(Int32ArraySamplePtr faceCounts, size_t numPoints, Alembic::AbcGeom::IN3fGeomParam & Ns, std::vector<Vector3>& N, bool& perPoint, chrono_t curTime, bool interpolate, unsigned numThreads);
 
 bool isTopologyChanging(IObject iObj);
 
-bool isTopologyChanging(std::vector<Alembic::AbcGeom::IObject> _objs);
+bool isAttributeAnimated(IObject iObj);
 
 Box3d getBounds( IObject iObj, chrono_t curTime );
 
 void buildBboxPrimitives(GeometryList& out, unsigned obj);
 
-void buildABCPrimitives(GeometryList& out, unsigned obj, const Alembic::AbcGeom::IObject iObj, chrono_t curTime);
+// Build the faces of a mesh, either as one Polygon per face, or all of them in a single
+// PolyMesh primitive. Meshes a PolyMesh can't hold are built as Polygons anyway.
+void buildABCPrimitives(GeometryList& out, unsigned obj, Int32ArraySamplePtr _fc, Int32ArraySamplePtr _fi, bool singleMesh = false);
+
+// Read the groups in mask (Mask_Primitives, Mask_Points, Mask_Attributes) of one object.
+// Without bakeXforms, points stay in object space and the parent transforms go to stage.matrix.
+// Big meshes are split across numThreads threads (0 means one per CPU).
+// Parent matrices come from xformCache, so objects under the same xforms share them.
+void stageObject(const Alembic::AbcGeom::IObject iObj, ObjectStage& stage, unsigned mask,
+		bool bbox, chrono_t curTime, bool interpolate, unsigned numThreads, XformCache* xformCache,
+		bool useVelocities = false, ConstantPointCache* constantPoints = NULL, bool bakeXforms = true);
 
 
 
@@ -32,6 +32,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "DDImage/Vector3.h"
 #include "DDImage/Matrix4.h"
 #include "DDImage/Quaternion.h"
+
+#include <algorithm>
 //-*****************************************************************************
 
 using namespace DD::Image;
@@ -47,6 +49,39 @@ double getWeightAndIndex(double iFrame,
     if (numSamps == 0)
         numSamps = 1;
 
+    // Uniform sampling doesn't need to search for the samples
+    const TimeSamplingType& type = iTime->getTimeSamplingType();
+    if (type.isUniform())
+    {
+        const chrono_t first = iTime->getSampleTime(0);
+        const chrono_t step = type.getTimePerCycle();
+        const Alembic::AbcCoreAbstract::index_t last = numSamps - 1;
+
+        if (iFrame <= first || numSamps == 1) {
+            oIndex = oCeilIndex = 0;
+            return 0.0;
+        }
+        if (iFrame >= first + step * last) {
+            oIndex = oCeilIndex = last;
+            return 0.0;
+        }
+
+        oIndex = std::min(Alembic::AbcCoreAbstract::index_t(floor((iFrame - first) / step)), last);
+        oCeilIndex = oIndex;
+
+        // The division can round down when iFrame is right on a sample
+        if (oIndex < last && first + step * (oIndex + 1) <= iFrame + 1e-9) {
+            oIndex = oCeilIndex = oIndex + 1;
+        }
+
+        const chrono_t floorTime = first + step * oIndex;
+        if (fabs(iFrame - floorTime) < 0.0001)
+            return 0.0;
+
+        oCeilIndex = oIndex + 1;
+        return (iFrame - floorTime) / step;
+    }
+
     std::pair<Alembic::AbcCoreAbstract::index_t, double> floorIndex =
         iTime->getFloorIndex(iFrame, numSamps);
 
@@ -68,6 +103,89 @@ double getWeightAndIndex(double iFrame,
         (ceilIndex.second - floorIndex.second);
 }
 
+//-*****************************************************************************
+
+SampleTimeCache::SampleTimeCache(chrono_t time)
+{
+	m_time = time;
+}
+
+void SampleTimeCache::reset(chrono_t time)
+{
+	m_time = time;
+	m_intervals.clear();
+	m_samplings.clear();
+}
+
+void SampleTimeCache::add(Alembic::AbcCoreAbstract::TimeSamplingPtr ts, size_t numSamps)
+{
+	if (!ts)
+		return;
+
+	const SamplingId id(ts.get(), numSamps);
+	if (m_intervals.find(id) != m_intervals.end())
+		return;
+
+	SampleInterval interval;
+	interval.weight = ::getWeightAndIndex(m_time, ts, numSamps, interval.floorIndex, interval.ceilIndex);
+	interval.nearestIndex = ISampleSelector(m_time).getIndex(ts, numSamps);
+
+	m_intervals[id] = interval;
+	m_samplings.push_back(ts);
+}
+
+const SampleInterval SampleTimeCache::getInterval(Alembic::AbcCoreAbstract::TimeSamplingPtr ts, size_t numSamps) const
+{
+	std::map<SamplingId, SampleInterval>::const_iterator it = m_intervals.find(SamplingId(ts.get(), numSamps));
+	if (it != m_intervals.end())
+		return it->second;
+
+	SampleInterval interval;
+	interval.weight = ::getWeightAndIndex(m_time, ts, numSamps, interval.floorIndex, interval.ceilIndex);
+	interval.nearestIndex = ISampleSelector(m_time).getIndex(ts, numSamps);
+	return interval;
+}
+
+double SampleTimeCache::getWeightAndIndex(Alembic::AbcCoreAbstract::TimeSamplingPtr ts, size_t numSamps,
+		Alembic::AbcCoreAbstract::index_t & oIndex,
+		Alembic::AbcCoreAbstract::index_t & oCeilIndex) const
+{
+	const SampleInterval interval = getInterval(ts, numSamps);
+	oIndex = interval.floorIndex;
+	oCeilIndex = interval.ceilIndex;
+	return interval.weight;
+}
+
+Alembic::AbcCoreAbstract::index_t SampleTimeCache::getNearestIndex(Alembic::AbcCoreAbstract::TimeSamplingPtr ts, size_t numSamps) const
+{
+	return getInterval(ts, numSamps).nearestIndex;
+}
+
+//-*****************************************************************************
+
+double getWeightAndIndex(double iFrame,
+    Alembic::AbcCoreAbstract::TimeSamplingPtr iTime, size_t numSamps,
+    Alembic::AbcCoreAbstract::index_t & oIndex,
+    Alembic::AbcCoreAbstract::index_t & oCeilIndex,
+    const SampleTimeCache* sampleTimes)
+{
+	if (sampleTimes && sampleTimes->getTime() == iFrame)
+		return sampleTimes->getWeightAndIndex(iTime, numSamps, oIndex, oCeilIndex);
+
+	return getWeightAndIndex(iFrame, iTime, numSamps, oIndex, oCeilIndex);
+}
+
+Alembic::AbcCoreAbstract::index_t getNearestIndex(double iFrame,
+    Alembic::AbcCoreAbstract::TimeSamplingPtr iTime, size_t numSamps,
+    const SampleTimeCache* sampleTimes)
+{
+	if (sampleTimes && sampleTimes->getTime() == iFrame)
+		return sampleTimes->getNearestIndex(iTime, numSamps);
+
+	return ISampleSelector(iFrame).getIndex(iTime, numSamps);
+}
+
+//-*****************************************************************************
 
 DD::Image::Matrix4 Matrix4_lerp(const DD::Image::Matrix4 &start_mtx, const DD::Image::Matrix4 &end_mtx, double amt)
     {
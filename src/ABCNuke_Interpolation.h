@@ -36,6 +36,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "DDImage/DDMath.h"
 #include "ABCNuke_MatrixHelper.h"
 
+#include <map>
+#include <vector>
+
 using namespace DD::Image;
 
 double getWeightAndIndex(double iFrame,
@@ -43,6 +46,59 @@ double getWeightAndIndex(double iFrame,
     Alembic::AbcCoreAbstract::index_t & oIndex,
     Alembic::AbcCoreAbstract::index_t & oCeilIndex);
 
+// Where one time falls between the samples of a TimeSampling
+struct SampleInterval
+{
+	Alembic::AbcCoreAbstract::index_t nearestIndex;
+	Alembic::AbcCoreAbstract::index_t floorIndex;
+	Alembic::AbcCoreAbstract::index_t ceilIndex;
+	double weight;
+};
+
+// Sample lookups at one time, for all the TimeSamplings of an archive.
+// Most objects share a handful of TimeSamplings, so the floor and ceil
+// searches are done once per TimeSampling, not once per object and parent.
+// Lookups don't lock: everything is added before the cook threads start.
+// TimeSamplings that weren't added are looked up directly.
+class SampleTimeCache
+{
+public:
+	SampleTimeCache(Alembic::AbcCoreAbstract::chrono_t time = 0);
+
+	// Forget all lookups, and start over at a new time
+	void reset(Alembic::AbcCoreAbstract::chrono_t time);
+	Alembic::AbcCoreAbstract::chrono_t getTime() const { return m_time; }
+
+	void add(Alembic::AbcCoreAbstract::TimeSamplingPtr ts, size_t numSamps);
+
+	// Same as getWeightAndIndex(getTime(), ts, numSamps, oIndex, oCeilIndex)
+	double getWeightAndIndex(Alembic::AbcCoreAbstract::TimeSamplingPtr ts, size_t numSamps,
+			Alembic::AbcCoreAbstract::index_t & oIndex,
+			Alembic::AbcCoreAbstract::index_t & oCeilIndex) const;
+
+	// Same as ISampleSelector(getTime()).getIndex(ts, numSamps)
+	Alembic::AbcCoreAbstract::index_t getNearestIndex(Alembic::AbcCoreAbstract::TimeSamplingPtr ts, size_t numSamps) const;
+
+private:
+	const SampleInterval getInterval(Alembic::AbcCoreAbstract::TimeSamplingPtr ts, size_t numSamps) const;
+
+	typedef std::pair<const Alembic::AbcCoreAbstract::TimeSampling*, size_t> SamplingId;
+
+	Alembic::AbcCoreAbstract::chrono_t m_time;
+	std::map<SamplingId, SampleInterval> m_intervals;
+	std::vector<Alembic::AbcCoreAbstract::TimeSamplingPtr> m_samplings;  // keep the keys alive
+};
+
+// Use the cache if there is one for iFrame, otherwise look the samples up directly
+double getWeightAndIndex(double iFrame,
+    Alembic::AbcCoreAbstract::TimeSamplingPtr iTime, size_t numSamps,
+    Alembic::AbcCoreAbstract::index_t & oIndex,
+    Alembic::AbcCoreAbstract::index_t & oCeilIndex,
+    const SampleTimeCache* sampleTimes);
+Alembic::AbcCoreAbstract::index_t getNearestIndex(double iFrame,
+    Alembic::AbcCoreAbstract::TimeSamplingPtr iTime, size_t numSamps,
+    const SampleTimeCache* sampleTimes);
+
 // Not needed. Using OpenEXR::Imath functions for now
 DD::Image::Matrix4 Matrix4_lerp(const DD::Image::Matrix4 &start_mtx, const DD::Image::Matrix4 &end_mtx, double amt);
 
@@ -29,6 +29,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 //-*****************************************************************************
 #include "ABCNuke_MatrixHelper.h"
+#include "ABCNuke_SceneIndex.h"
 #include "DDImage/Vector3.h"
 #include "DDImage/Matrix4.h"
 #include "DDImage/Quaternion.h"
@@ -133,7 +134,100 @@ Imath::V3d lerp(const Imath::V3d &a, const Imath::V3d &b, double amt)
 }
 
 
-void accumXform( Imath::M44d &xf, IObject obj, chrono_t curTime, bool interpolate)
+// Most xform samples we'll keep
+#define MAX_XFORM_SAMPLES 200000
+
+void XformSampleCache::setArchive( Alembic::AbcCoreAbstract::ArchiveReaderPtr archive )
+{
+	DD::Image::Guard guard(m_lock);
+	if (m_archive.lock() != archive) {
+		m_samples.clear();
+		m_sampleMap.clear();
+		m_archive = archive;
+	}
+}
+
+const XformSampleData XformSampleCache::getSample( IXform x, unsigned id, Alembic::AbcCoreAbstract::index_t index )
+{
+	const SampleId sampleId(id, index);
+	{
+		DD::Image::Guard guard(m_lock);
+		std::map<SampleId, SampleList::iterator>::iterator it = m_sampleMap.find(sampleId);
+		if (it != m_sampleMap.end()) {
+			m_samples.splice(m_samples.begin(), m_samples, it->second);  // move to the front
+			return it->second->second;
+		}
+	}
+
+	XformSampleData data;
+	const ISampleSelector iss(index);
+	data.matrix = x.getSchema().getValue(iss).getMatrix();
+	DecomposeXForm(data.matrix, data.scale, data.shear, data.rotation, data.translation);
+
+	DD::Image::Guard guard(m_lock);
+
+	// Another thread might have read it in the meantime
+	if (m_sampleMap.find(sampleId) != m_sampleMap.end())
+		return data;
+
+	m_samples.push_front(std::make_pair(sampleId, data));
+	m_sampleMap[sampleId] = m_samples.begin();
+
+	while (m_samples.size() > MAX_XFORM_SAMPLES) {
+		m_sampleMap.erase(m_samples.back().first);
+		m_samples.pop_back();
+	}
+	return data;
+}
+
+//-*****************************************************************************
+
+// Same as accumXform(), with the samples coming from sampleCache. id is x's in the scene index.
+static void accumCachedXform( Imath::M44d &xf, IXform x, unsigned id, chrono_t curTime, bool interpolate, XformSampleCache* sampleCache,
+		const SampleTimeCache* sampleTimes)
+{
+	IXformSchema schema = x.getSchema();
+	size_t numSamples = schema.getNumSamples();
+	if (numSamples == 0)
+		return;
+
+	if (schema.isConstant()) {
+		xf *= sampleCache->getSample(x, id, 0).matrix;
+		return;
+	}
+
+	TimeSamplingPtr timeSampler = schema.getTimeSampling();
+
+	if (interpolate) {
+		Alembic::AbcCoreAbstract::index_t floorIdx, ceilIdx;
+		double amt = getWeightAndIndex(curTime, timeSampler, numSamples, floorIdx, ceilIdx, sampleTimes);
+
+		if (amt != 0 && floorIdx != ceilIdx) {
+			const XformSampleData start = sampleCache->getSample(x, id, floorIdx);
+			const XformSampleData end = sampleCache->getSample(x, id, ceilIdx);
+
+			Imath::Quatd quat_r = end.rotation;
+			if ((start.rotation ^ quat_r) < 0)
+			{
+				quat_r = -quat_r;
+			}
+
+			xf *= RecomposeXForm(Imath::lerp(start.scale, end.scale, amt),
+					Imath::lerp(start.shear, end.shear, amt),
+					Imath::slerp(start.rotation, quat_r, amt),
+					Imath::lerp(start.translation, end.translation, amt));
+			return;
+		}
+	}
+
+	// get nearest sample
+	xf *= sampleCache->getSample(x, id, getNearestIndex(curTime, timeSampler, numSamples, sampleTimes)).matrix;
+}
+
+//-*****************************************************************************
+
+void accumXform( Imath::M44d &xf, IObject obj, chrono_t curTime, bool interpolate,
+		const SampleTimeCache* sampleTimes)
 {
 	if ( IXform::matches( obj.getHeader() ) )
 	{
@@ -152,7 +246,7 @@ void accumXform( Imath::M44d &xf, IObject obj, chrono_t curTime, bool interpolat
 				Alembic::AbcCoreAbstract::index_t floorIdx, ceilIdx;
 
 				double amt = getWeightAndIndex(curTime, timeSampler,
-						x.getSchema().getNumSamples(), floorIdx, ceilIdx);
+						x.getSchema().getNumSamples(), floorIdx, ceilIdx, sampleTimes);
 
 				if (amt != 0 && floorIdx != ceilIdx) {
 
@@ -255,3 +349,98 @@ const Matrix4 getConcatMatrix( IObject iObj, chrono_t curTime , bool interpolate
 
 	return ret_matrix;
 }
+
+//-*****************************************************************************
+
+XformCache::XformCache(const SceneIndex& index, chrono_t curTime, bool interpolate, XformSampleCache* sampleCache,
+		const SampleTimeCache* sampleTimes) : m_index(index)
+{
+	m_time = curTime;
+	m_interpolate = interpolate;
+	m_sampleCache = sampleCache;
+	m_sampleTimes = sampleTimes;
+
+	m_matrices.resize(index.objects.size());
+	m_known.resize(index.objects.size(), false);
+
+	// The index holds on to its objects, so their readers stay put while we're around
+	for (unsigned g = 0; g < index.numGeos(); g++) {
+		m_geos[index.geo(g).object.getPtr().get()] = index.geos[g];
+	}
+}
+
+Imath::M44d XformCache::getWorldMatrix( int obj )
+{
+	Imath::M44d xf;
+	xf.makeIdentity();
+
+	// Objects right under the archive's top have no parent
+	if (obj < 0)
+		return xf;
+
+	{
+		DD::Image::Guard guard(m_lock);
+		if (m_known[obj])
+			return m_matrices[obj];
+	}
+
+	// Not there yet. Work it out from the parent's.
+	// (Two threads might both get here, but they'd compute the same thing)
+	const SceneObject& object = m_index.objects[obj];
+	if ( object.type == kXformObject && m_sampleCache )
+	{
+		IXform x( object.object, kWrapExisting );
+		accumCachedXform( xf, x, object.id, m_time, m_interpolate, m_sampleCache, m_sampleTimes );
+	}
+	else
+	{
+		accumXform( xf, object.object, m_time, m_interpolate, m_sampleTimes );
+	}
+	xf *= getWorldMatrix( object.parent );
+
+	DD::Image::Guard guard(m_lock);
+	m_matrices[obj] = xf;
+	m_known[obj] = true;
+	return xf;
+}
+
+const Matrix4 XformCache::getConcatMatrix( IObject iObj )
+{
+	std::map<const Alembic::AbcCoreAbstract::ObjectReader*, int>::const_iterator it = m_geos.find(iObj.getPtr().get());
+	if (it == m_geos.end())  // not one of ours
+		return ::getConcatMatrix( iObj, m_time, m_interpolate );
+
+	return convert( getWorldMatrix( m_index.objects[it->second].parent ) );
+}
+
+//-*****************************************************************************
+
+const Matrix4 getConcatMatrix( IObject iObj, chrono_t curTime, bool interpolate, XformCache* xformCache)
+{
+	if (xformCache)
+		return xformCache->getConcatMatrix( iObj );
+
+	return getConcatMatrix( iObj, curTime, interpolate );
+}
+
+//-*****************************************************************************
+
+// True if any of the parent xforms of iObj is animated
+bool isConcatMatrixAnimated( IObject iObj )
+{
+	IObject parent = iObj.getParent();
+
+	while ( parent )
+	{
+		if ( IXform::matches( parent.getHeader() ) )
+		{
+			IXform x( parent, kWrapExisting );
+			if (!x.getSchema().isConstant()) {
+				return true;
+			}
+		}
+		parent = parent.getParent();
+	}
+
+	return false;
+}
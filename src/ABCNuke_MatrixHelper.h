@@ -33,15 +33,23 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "DDImage/Vector3.h"
 #include "DDImage/Matrix4.h"
 #include "DDImage/Quaternion.h"
+#include "DDImage/Thread.h"
 
 #include <Alembic/Abc/All.h>
 #include <Alembic/AbcGeom/All.h>
 
 #include "ABCNuke_Interpolation.h"
 
+#include <list>
+#include <map>
+#include <vector>
+
 using namespace DD::Image;
 using namespace Alembic::AbcGeom;
 
+class SampleTimeCache;
+struct SceneIndex;
+
 typedef std::set<Abc::chrono_t> SampleTimeSet;
 typedef std::map<Abc::chrono_t, M44d> MatrixSampleMap;
 void decomposeMatrix(const Matrix4& mat, Vector3& scale, Vector3& translation, Quaternion& rotation );
@@ -54,9 +62,82 @@ M44d RecomposeXForm(const Imath::V3d &scale, const Imath::V3d &shear, const Imat
 //-*****************************************************************************
 
 Imath::V3d lerp(const Imath::V3d &a, const Imath::V3d &b, double amt);
-void accumXform( Imath::M44d &xf, IObject obj, chrono_t curTime = 0, bool interpolate = false);
+
+// An xform sample, and its decomposition for interpolation
+struct XformSampleData
+{
+	Imath::M44d matrix;
+	Imath::V3d scale;
+	Imath::V3d shear;
+	Imath::Quatd rotation;
+	Imath::V3d translation;
+};
+
+// Xform samples read from an archive, kept across cooks.
+// Motion blur cooks the same frame at several shutter times, and they all
+// interpolate between the same samples, so each sample is only read and
+// decomposed once. Objects are told apart by their id in the archive's scene index.
+// The least recently used samples go once there are too many. Safe to use from several threads.
+class XformSampleCache
+{
+public:
+	XformSampleCache() {}
+
+	// Forget all samples if they came from a different archive
+	void setArchive( Alembic::AbcCoreAbstract::ArchiveReaderPtr archive );
+
+	const XformSampleData getSample( IXform x, unsigned id, Alembic::AbcCoreAbstract::index_t index );
+
+private:
+	typedef std::pair<unsigned, Alembic::AbcCoreAbstract::index_t> SampleId;
+	typedef std::list<std::pair<SampleId, XformSampleData> > SampleList;  // most recently used first
+
+	Alembic::Util::weak_ptr<Alembic::AbcCoreAbstract::ArchiveReader> m_archive;
+	SampleList m_samples;
+	std::map<SampleId, SampleList::iterator> m_sampleMap;
+	DD::Image::Lock m_lock;
+};
+
+// Multiply xf by the local matrix of obj (if it's an IXform) at curTime.
+// Samples are looked up in sampleTimes, if there are any.
+void accumXform( Imath::M44d &xf, IObject obj, chrono_t curTime = 0, bool interpolate = false,
+		const SampleTimeCache* sampleTimes = NULL);
 Matrix4 convert( const Imath::M44d &from );
 Imath::M44d convert( const Matrix4 &from );
 const Matrix4 getConcatMatrix( IObject iObj, chrono_t curTime = 0, bool interpolate = false);
 
+// World matrices of the xforms in a scene index, at one time.
+// Filled in top-down as objects ask for them, so objects sharing parents
+// only read and interpolate each xform once. Safe to use from several threads.
+class XformCache
+{
+public:
+	XformCache(const SceneIndex& index, chrono_t curTime = 0, bool interpolate = false,
+			XformSampleCache* sampleCache = NULL, const SampleTimeCache* sampleTimes = NULL);
+
+	// Same as getConcatMatrix(iObj, curTime, interpolate), for the meshes of the index
+	const Matrix4 getConcatMatrix( IObject iObj );
+
+	// Sample lookups at curTime, for the objects cooked along with the xforms. May be NULL.
+	const SampleTimeCache* getSampleTimes() const { return m_sampleTimes; }
+
+private:
+	// Accumulated matrix of the object at position obj in the index, and all its parents
+	Imath::M44d getWorldMatrix( int obj );
+
+	const SceneIndex& m_index;
+	chrono_t m_time;
+	bool m_interpolate;
+	XformSampleCache* m_sampleCache;
+	const SampleTimeCache* m_sampleTimes;
+	std::map<const Alembic::AbcCoreAbstract::ObjectReader*, int> m_geos;  // positions of the meshes
+	std::vector<Imath::M44d> m_matrices;  // per object in the index
+	std::vector<bool> m_known;            // set once its matrix is in m_matrices
+	DD::Image::Lock m_lock;
+};
+
+// Use the cache if there is one, otherwise read the parents directly
+const Matrix4 getConcatMatrix( IObject iObj, chrono_t curTime, bool interpolate, XformCache* xformCache);
+bool isConcatMatrixAnimated( IObject iObj );
+
 #endif
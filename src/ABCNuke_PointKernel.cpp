@@ -0,0 +1,370 @@
+/*
+Copyright (c) 2011, Ivan Busquets
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+ * Neither the name of Ivan Busquets nor the names of its contributors may
+   be used to endorse or promote products derived from this software without
+   specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+//-*****************************************************************************
+#include "ABCNuke_PointKernel.h"
+//-*****************************************************************************
+
+#include <cmath>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ABCNUKE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+
+//-*****************************************************************************
+// Scalar versions. Same operation order as Matrix4::transform()
+//-*****************************************************************************
+
+static inline void transformPoint(const float* m, float x, float y, float z, float* out)
+{
+	out[0] = m[0] * x + m[4] * y + m[8] * z + m[12];
+	out[1] = m[1] * x + m[5] * y + m[9] * z + m[13];
+	out[2] = m[2] * x + m[6] * y + m[10] * z + m[14];
+}
+
+static void transformPointsScalar(const float* src, float* dst, size_t begin, size_t numPoints, const float* m)
+{
+	for (size_t i = begin; i < numPoints; i++) {
+		const float* p = src + i * 3;
+		transformPoint(m, p[0], p[1], p[2], dst + i * 3);
+	}
+}
+
+static void lerpTransformPointsScalar(const float* a, const float* b, float t,
+		float* dst, size_t begin, size_t numPoints, const float* m)
+{
+	for (size_t i = begin; i < numPoints; i++) {
+		const float* pa = a + i * 3;
+		const float* pb = b + i * 3;
+		transformPoint(m,
+				pa[0] + (pb[0] - pa[0]) * t,
+				pa[1] + (pb[1] - pa[1]) * t,
+				pa[2] + (pb[2] - pa[2]) * t,
+				dst + i * 3);
+	}
+}
+
+static void velocityTransformPointsScalar(const float* p, const float* v, float dt,
+		float* dst, size_t begin, size_t numPoints, const float* m)
+{
+	for (size_t i = begin; i < numPoints; i++) {
+		const float* pp = p + i * 3;
+		const float* pv = v + i * 3;
+		transformPoint(m,
+				pp[0] + pv[0] * dt,
+				pp[1] + pv[1] * dt,
+				pp[2] + pv[2] * dt,
+				dst + i * 3);
+	}
+}
+
+static void normalizeVectorsScalar(float* v, size_t begin, size_t numVectors)
+{
+	for (size_t i = begin; i < numVectors; i++) {
+		float* p = v + i * 3;
+		float len = sqrtf(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+		if (len > 0) {
+			p[0] = p[0] / len;
+			p[1] = p[1] / len;
+			p[2] = p[2] / len;
+		}
+	}
+}
+
+#ifdef ABCNUKE_X86_KERNELS
+
+//-*****************************************************************************
+// SSE versions. One point per iteration, one matrix row per lane:
+// col0 * x + col1 * y + col2 * z + col3
+// Every 4-wide load/store also touches the next point's x, so the last point
+// is always left to the scalar version.
+//-*****************************************************************************
+
+static inline __m128 transformPointSSE(const __m128* cols, __m128 x, __m128 y, __m128 z)
+{
+	return _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(cols[0], x),
+			_mm_mul_ps(cols[1], y)),
+			_mm_mul_ps(cols[2], z)),
+			cols[3]);
+}
+
+static void transformPointsSSE(const float* src, float* dst, size_t numPoints, const float* m)
+{
+	const __m128 cols[4] = { _mm_loadu_ps(m), _mm_loadu_ps(m + 4), _mm_loadu_ps(m + 8), _mm_loadu_ps(m + 12) };
+
+	size_t i = 0;
+	for (; i + 1 < numPoints; i++) {
+		const float* p = src + i * 3;
+		__m128 r = transformPointSSE(cols, _mm_set1_ps(p[0]), _mm_set1_ps(p[1]), _mm_set1_ps(p[2]));
+		_mm_storeu_ps(dst + i * 3, r);
+	}
+	transformPointsScalar(src, dst, i, numPoints, m);
+}
+
+static void lerpTransformPointsSSE(const float* a, const float* b, float t,
+		float* dst, size_t numPoints, const float* m)
+{
+	const __m128 cols[4] = { _mm_loadu_ps(m), _mm_loadu_ps(m + 4), _mm_loadu_ps(m + 8), _mm_loadu_ps(m + 12) };
+	const __m128 vt = _mm_set1_ps(t);
+
+	size_t i = 0;
+	for (; i + 1 < numPoints; i++) {
+		__m128 pa = _mm_loadu_ps(a + i * 3);
+		__m128 pb = _mm_loadu_ps(b + i * 3);
+		__m128 p = _mm_add_ps(pa, _mm_mul_ps(_mm_sub_ps(pb, pa), vt));
+		__m128 r = transformPointSSE(cols,
+				_mm_shuffle_ps(p, p, _MM_SHUFFLE(0,0,0,0)),
+				_mm_shuffle_ps(p, p, _MM_SHUFFLE(1,1,1,1)),
+				_mm_shuffle_ps(p, p, _MM_SHUFFLE(2,2,2,2)));
+		_mm_storeu_ps(dst + i * 3, r);
+	}
+	lerpTransformPointsScalar(a, b, t, dst, i, numPoints, m);
+}
+
+static void velocityTransformPointsSSE(const float* p, const float* v, float dt,
+		float* dst, size_t numPoints, const float* m)
+{
+	const __m128 cols[4] = { _mm_loadu_ps(m), _mm_loadu_ps(m + 4), _mm_loadu_ps(m + 8), _mm_loadu_ps(m + 12) };
+	const __m128 vdt = _mm_set1_ps(dt);
+
+	size_t i = 0;
+	for (; i + 1 < numPoints; i++) {
+		__m128 pp = _mm_loadu_ps(p + i * 3);
+		__m128 pv = _mm_loadu_ps(v + i * 3);
+		__m128 q = _mm_add_ps(pp, _mm_mul_ps(pv, vdt));
+		__m128 r = transformPointSSE(cols,
+				_mm_shuffle_ps(q, q, _MM_SHUFFLE(0,0,0,0)),
+				_mm_shuffle_ps(q, q, _MM_SHUFFLE(1,1,1,1)),
+				_mm_shuffle_ps(q, q, _MM_SHUFFLE(2,2,2,2)));
+		_mm_storeu_ps(dst + i * 3, r);
+	}
+	velocityTransformPointsScalar(p, v, dt, dst, i, numPoints, m);
+}
+
+// Same operations as the scalar version, so results are identical.
+// The 4th lane (next vector's x) is written back untouched.
+static void normalizeVectorsSSE(float* v, size_t numVectors)
+{
+	const __m128 xyz = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+	const __m128 zero = _mm_setzero_ps();
+
+	size_t i = 0;
+	for (; i + 1 < numVectors; i++) {
+		__m128 p = _mm_loadu_ps(v + i * 3);
+		__m128 sq = _mm_mul_ps(p, p);
+		__m128 dot = _mm_add_ss(_mm_add_ss(sq, _mm_shuffle_ps(sq, sq, _MM_SHUFFLE(1,1,1,1))),
+				_mm_shuffle_ps(sq, sq, _MM_SHUFFLE(2,2,2,2)));
+		__m128 len = _mm_sqrt_ss(dot);
+		len = _mm_shuffle_ps(len, len, _MM_SHUFFLE(0,0,0,0));
+		__m128 keep = _mm_and_ps(xyz, _mm_cmpgt_ps(len, zero));
+		__m128 r = _mm_or_ps(_mm_and_ps(keep, _mm_div_ps(p, len)), _mm_andnot_ps(keep, p));
+		_mm_storeu_ps(v + i * 3, r);
+	}
+	normalizeVectorsScalar(v, i, numVectors);
+}
+
+//-*****************************************************************************
+// AVX2 versions. Two points per iteration, one in each 128-bit lane, packed
+// back to 6 floats with a cross-lane permute. The 8-wide load/store spills
+// into the following point, so the last 2 points are left to the SSE version.
+// No FMA, so results stay identical to the scalar version.
+//-*****************************************************************************
+
+__attribute__((target("avx2")))
+static inline __m256 transformPairAVX2(const __m256* cols, __m256 x, __m256 y, __m256 z)
+{
+	return _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(cols[0], x),
+			_mm256_mul_ps(cols[1], y)),
+			_mm256_mul_ps(cols[2], z)),
+			cols[3]);
+}
+
+__attribute__((target("avx2")))
+static void transformPointsAVX2(const float* src, float* dst, size_t numPoints, const float* m)
+{
+	__m256 cols[4];
+	for (int c = 0; c < 4; c++) {
+		__m128 col = _mm_loadu_ps(m + c * 4);
+		cols[c] = _mm256_insertf128_ps(_mm256_castps128_ps256(col), col, 1);
+	}
+	const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+
+	size_t i = 0;
+	for (; i + 3 <= numPoints; i += 2) {
+		const float* p = src + i * 3;
+		__m256 x = _mm256_setr_ps(p[0], p[0], p[0], p[0], p[3], p[3], p[3], p[3]);
+		__m256 y = _mm256_setr_ps(p[1], p[1], p[1], p[1], p[4], p[4], p[4], p[4]);
+		__m256 z = _mm256_setr_ps(p[2], p[2], p[2], p[2], p[5], p[5], p[5], p[5]);
+		__m256 r = transformPairAVX2(cols, x, y, z);
+		_mm256_storeu_ps(dst + i * 3, _mm256_permutevar8x32_ps(r, pack));
+	}
+	if (i < numPoints) {
+		transformPointsSSE(src + i * 3, dst + i * 3, numPoints - i, m);
+	}
+}
+
+__attribute__((target("avx2")))
+static void lerpTransformPointsAVX2(const float* a, const float* b, float t,
+		float* dst, size_t numPoints, const float* m)
+{
+	__m256 cols[4];
+	for (int c = 0; c < 4; c++) {
+		__m128 col = _mm_loadu_ps(m + c * 4);
+		cols[c] = _mm256_insertf128_ps(_mm256_castps128_ps256(col), col, 1);
+	}
+	const __m256 vt = _mm256_set1_ps(t);
+	const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+	const __m256i splatX = _mm256_setr_epi32(0, 0, 0, 0, 3, 3, 3, 3);
+	const __m256i splatY = _mm256_setr_epi32(1, 1, 1, 1, 4, 4, 4, 4);
+	const __m256i splatZ = _mm256_setr_epi32(2, 2, 2, 2, 5, 5, 5, 5);
+
+	size_t i = 0;
+	for (; i + 3 <= numPoints; i += 2) {
+		// Lerp both points (6 floats, plus 2 we don't care about)
+		__m256 pa = _mm256_loadu_ps(a + i * 3);
+		__m256 pb = _mm256_loadu_ps(b + i * 3);
+		__m256 p = _mm256_add_ps(pa, _mm256_mul_ps(_mm256_sub_ps(pb, pa), vt));
+
+		__m256 r = transformPairAVX2(cols,
+				_mm256_permutevar8x32_ps(p, splatX),
+				_mm256_permutevar8x32_ps(p, splatY),
+				_mm256_permutevar8x32_ps(p, splatZ));
+		_mm256_storeu_ps(dst + i * 3, _mm256_permutevar8x32_ps(r, pack));
+	}
+	if (i < numPoints) {
+		lerpTransformPointsSSE(a + i * 3, b + i * 3, t, dst + i * 3, numPoints - i, m);
+	}
+}
+
+__attribute__((target("avx2")))
+static void velocityTransformPointsAVX2(const float* p, const float* v, float dt,
+		float* dst, size_t numPoints, const float* m)
+{
+	__m256 cols[4];
+	for (int c = 0; c < 4; c++) {
+		__m128 col = _mm_loadu_ps(m + c * 4);
+		cols[c] = _mm256_insertf128_ps(_mm256_castps128_ps256(col), col, 1);
+	}
+	const __m256 vdt = _mm256_set1_ps(dt);
+	const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+	const __m256i splatX = _mm256_setr_epi32(0, 0, 0, 0, 3, 3, 3, 3);
+	const __m256i splatY = _mm256_setr_epi32(1, 1, 1, 1, 4, 4, 4, 4);
+	const __m256i splatZ = _mm256_setr_epi32(2, 2, 2, 2, 5, 5, 5, 5);
+
+	size_t i = 0;
+	for (; i + 3 <= numPoints; i += 2) {
+		// Move both points along their velocities
+		__m256 pp = _mm256_loadu_ps(p + i * 3);
+		__m256 pv = _mm256_loadu_ps(v + i * 3);
+		__m256 q = _mm256_add_ps(pp, _mm256_mul_ps(pv, vdt));
+
+		__m256 r = transformPairAVX2(cols,
+				_mm256_permutevar8x32_ps(q, splatX),
+				_mm256_permutevar8x32_ps(q, splatY),
+				_mm256_permutevar8x32_ps(q, splatZ));
+		_mm256_storeu_ps(dst + i * 3, _mm256_permutevar8x32_ps(r, pack));
+	}
+	if (i < numPoints) {
+		velocityTransformPointsSSE(p + i * 3, v + i * 3, dt, dst + i * 3, numPoints - i, m);
+	}
+}
+
+//-*****************************************************************************
+
+static bool hasAVX2()
+{
+	static const bool avx2 = __builtin_cpu_supports("avx2");
+	return avx2;
+}
+
+#endif // ABCNUKE_X86_KERNELS
+
+//-*****************************************************************************
+
+void transformPoints(const float* src, float* dst, size_t numPoints, const float* matrix)
+{
+#ifdef ABCNUKE_X86_KERNELS
+	if (hasAVX2()) {
+		transformPointsAVX2(src, dst, numPoints, matrix);
+	}
+	else {
+		transformPointsSSE(src, dst, numPoints, matrix);
+	}
+#else
+	transformPointsScalar(src, dst, 0, numPoints, matrix);
+#endif
+}
+
+//-*****************************************************************************
+
+void lerpTransformPoints(const float* a, const float* b, float t,
+		float* dst, size_t numPoints, const float* matrix)
+{
+#ifdef ABCNUKE_X86_KERNELS
+	if (hasAVX2()) {
+		lerpTransformPointsAVX2(a, b, t, dst, numPoints, matrix);
+	}
+	else {
+		lerpTransformPointsSSE(a, b, t, dst, numPoints, matrix);
+	}
+#else
+	lerpTransformPointsScalar(a, b, t, dst, 0, numPoints, matrix);
+#endif
+}
+
+//-*****************************************************************************
+
+void velocityTransformPoints(const float* p, const float* v, float dt,
+		float* dst, size_t numPoints, const float* matrix)
+{
+#ifdef ABCNUKE_X86_KERNELS
+	if (hasAVX2()) {
+		velocityTransformPointsAVX2(p, v, dt, dst, numPoints, matrix);
+	}
+	else {
+		velocityTransformPointsSSE(p, v, dt, dst, numPoints, matrix);
+	}
+#else
+	velocityTransformPointsScalar(p, v, dt, dst, 0, numPoints, matrix);
+#endif
+}
+
+//-*****************************************************************************
+
+void normalizeVectors(float* v, size_t numVectors)
+{
+#ifdef ABCNUKE_X86_KERNELS
+	normalizeVectorsSSE(v, numVectors);
+#else
+	normalizeVectorsScalar(v, 0, numVectors);
+#endif
+}
@@ -0,0 +1,56 @@
+/*
+Copyright (c) 2011, Ivan Busquets
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+ * Neither the name of Ivan Busquets nor the names of its contributors may
+   be used to endorse or promote products derived from this software without
+   specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _ABCNuke_PointKernel_h_
+#define _ABCNuke_PointKernel_h_
+
+#include <cstddef>
+
+// Batch kernels for points stored as packed xyz floats (Imath::V3f, DD::Image::Vector3).
+// 'matrix' is a column-major 4x4 affine matrix, the same layout as DD::Image::Matrix4,
+// so &mtx[0][0] can be passed straight in. Results match Matrix4::transform() and
+// DD::Image::lerp() bit for bit.
+// An SSE or AVX2 version is picked at runtime depending on the CPU, with a scalar
+// fallback elsewhere. src/dst must not overlap.
+
+// dst[i] = matrix * src[i]
+void transformPoints(const float* src, float* dst, size_t numPoints, const float* matrix);
+
+// dst[i] = matrix * lerp(a[i], b[i], t)
+void lerpTransformPoints(const float* a, const float* b, float t,
+		float* dst, size_t numPoints, const float* matrix);
+
+// dst[i] = matrix * (p[i] + v[i] * dt)
+void velocityTransformPoints(const float* p, const float* v, float dt,
+		float* dst, size_t numPoints, const float* matrix);
+
+// v[i] = v[i] / |v[i]|, in place. Zero length vectors are left alone.
+void normalizeVectors(float* v, size_t numVectors);
+
+#endif
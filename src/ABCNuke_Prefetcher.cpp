@@ -0,0 +1,170 @@
+/*
+Copyright (c) 2011, Ivan Busquets
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+ * Neither the name of Ivan Busquets nor the names of its contributors may
+   be used to endorse or promote products derived from this software without
+   specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+//-*****************************************************************************
+#include "ABCNuke_Prefetcher.h"
+#include "ABCNuke_GeoHelper.h"
+//-*****************************************************************************
+
+#include <cmath>
+
+using namespace Alembic::AbcGeom;
+
+// Frame steps bigger than this count as a jump rather than playback
+#define MAX_PLAYBACK_STEP 2.0
+
+//-*****************************************************************************
+
+SamplePrefetcher::SamplePrefetcher()
+{
+	pthread_mutex_init(&m_mutex, NULL);
+	pthread_cond_init(&m_cond, NULL);
+	m_quit = false;
+	m_jobGeneration = 0;
+	m_interpolate = false;
+	m_useVelocities = false;
+	m_lastOutputFrame = 0;
+	m_lastSampleFrame = 0;
+	m_hasLast = false;
+
+	// The thread only gets started on the first request
+	m_running = false;
+}
+
+SamplePrefetcher::~SamplePrefetcher()
+{
+	pthread_mutex_lock(&m_mutex);
+	m_quit = true;
+	m_generation.add(1);
+	pthread_cond_signal(&m_cond);
+	pthread_mutex_unlock(&m_mutex);
+
+	if (m_running) {
+		pthread_join(m_thread, NULL);
+	}
+
+	pthread_cond_destroy(&m_cond);
+	pthread_mutex_destroy(&m_mutex);
+}
+
+//-*****************************************************************************
+
+int SamplePrefetcher::updateDirection(double outputFrame, float sampleFrame)
+{
+	pthread_mutex_lock(&m_mutex);
+
+	int direction = 0;
+	if (m_hasLast && sampleFrame != m_lastSampleFrame) {
+		double step = outputFrame - m_lastOutputFrame;
+		if (step > 0 && step <= MAX_PLAYBACK_STEP) {
+			direction = 1;
+		}
+		else if (step < 0 && step >= -MAX_PLAYBACK_STEP) {
+			direction = -1;
+		}
+	}
+
+	m_lastOutputFrame = outputFrame;
+	m_lastSampleFrame = sampleFrame;
+	m_hasLast = true;
+
+	pthread_mutex_unlock(&m_mutex);
+
+	return direction;
+}
+
+//-*****************************************************************************
+
+void SamplePrefetcher::request(const std::vector<IObject>& objs, const std::vector<chrono_t>& times, bool interpolate, bool useVelocities)
+{
+	pthread_mutex_lock(&m_mutex);
+
+	m_objs = objs;
+	m_times = times;
+	m_interpolate = interpolate;
+	m_useVelocities = useVelocities;
+	m_generation.add(1);
+
+	if (!m_running) {
+		m_running = pthread_create(&m_thread, NULL, run, this) == 0;
+	}
+	pthread_cond_signal(&m_cond);
+
+	pthread_mutex_unlock(&m_mutex);
+}
+
+//-*****************************************************************************
+
+void SamplePrefetcher::cancel()
+{
+	pthread_mutex_lock(&m_mutex);
+	m_generation.add(1);
+	m_objs.clear();
+	m_times.clear();
+	pthread_mutex_unlock(&m_mutex);
+}
+
+//-*****************************************************************************
+
+void* SamplePrefetcher::run(void* d)
+{
+	((SamplePrefetcher*)d)->loop();
+	return NULL;
+}
+
+void SamplePrefetcher::loop()
+{
+	for (;;) {
+		pthread_mutex_lock(&m_mutex);
+		while (!m_quit && m_jobGeneration == m_generation.load()) {
+			pthread_cond_wait(&m_cond, &m_mutex);
+		}
+		if (m_quit) {
+			pthread_mutex_unlock(&m_mutex);
+			return;
+		}
+
+		// Take a copy of the job, so requests can come in while we work on it
+		const unsigned generation = m_generation.load();
+		m_jobGeneration = generation;
+		std::vector<IObject> objs(m_objs);
+		std::vector<chrono_t> times(m_times);
+		bool interpolate = m_interpolate;
+		bool useVelocities = m_useVelocities;
+		pthread_mutex_unlock(&m_mutex);
+
+		for (unsigned t = 0; t < times.size(); t++) {
+			for (unsigned i = 0; i < objs.size(); i++) {
+				if (generation != m_generation.load())  // cancelled, or a newer request came in
+					break;
+				prefetchSamples(objs[i], times[t], interpolate, useVelocities);
+			}
+		}
+	}
+}
@@ -0,0 +1,89 @@
+/*
+Copyright (c) 2011, Ivan Busquets
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+ * Neither the name of Ivan Busquets nor the names of its contributors may
+   be used to endorse or promote products derived from this software without
+   specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _ABCNuke_Prefetcher_h_
+#define _ABCNuke_Prefetcher_h_
+
+//-*****************************************************************************
+#include <Alembic/AbcGeom/All.h>
+//-*****************************************************************************
+
+#include "ABCNuke_ThreadHelper.h"
+
+#include <pthread.h>
+#include <vector>
+
+using namespace Alembic::AbcGeom;
+
+// Reads samples for upcoming frames into the sample cache on a background thread,
+// so playback doesn't have to wait for the archive.
+// The caller works out which frames come next. Every new request cancels the
+// previous one, so jumping somewhere else in the timeline is cheap.
+class SamplePrefetcher
+{
+public:
+	SamplePrefetcher();
+	~SamplePrefetcher();
+
+	// Track playback. Returns 1 or -1 if frames have been moving forwards or
+	// backwards one at a time, or 0 after a jump, a held frame, or the first call.
+	int updateDirection(double outputFrame, float sampleFrame);
+
+	// Read the samples of objs needed at each of times, in order.
+	// Cancels whatever was being read before.
+	void request(const std::vector<IObject>& objs, const std::vector<chrono_t>& times, bool interpolate, bool useVelocities);
+
+	// Stop reading as soon as possible
+	void cancel();
+
+private:
+	static void* run(void* d);
+	void loop();
+
+	pthread_t m_thread;
+	pthread_mutex_t m_mutex;
+	pthread_cond_t m_cond;
+	bool m_running;
+	bool m_quit;
+
+	// Bumped on every request or cancel, so the thread can tell its job is stale
+	AtomicValue<unsigned> m_generation;
+	unsigned m_jobGeneration;
+
+	std::vector<IObject> m_objs;
+	std::vector<chrono_t> m_times;
+	bool m_interpolate;
+	bool m_useVelocities;
+
+	double m_lastOutputFrame;
+	float m_lastSampleFrame;
+	bool m_hasLast;
+};
+
+#endif
@@ -0,0 +1,183 @@
+/*
+Copyright (c) 2011, Ivan Busquets
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+ * Neither the name of Ivan Busquets nor the names of its contributors may
+   be used to endorse or promote products derived from this software without
+   specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+//-*****************************************************************************
+#include "ABCNuke_SampleCache.h"
+#include "DDImage/Thread.h"
+//-*****************************************************************************
+
+#include <cstdlib>
+#include <list>
+#include <map>
+
+using namespace Alembic::Abc;
+
+struct SampleEntry
+{
+	SampleKey key;
+	Alembic::AbcCoreAbstract::ArraySamplePtr sample;
+	size_t bytes;
+};
+
+// Most recently used samples at the front
+typedef std::list<SampleEntry> SampleList;
+typedef std::map<SampleKey, SampleList::iterator> SampleMap;
+
+static SampleList s_samples;
+static SampleMap s_sampleMap;
+static size_t s_bytes = 0;
+static size_t s_budget = 0;
+static bool s_budgetSet = false;
+static DD::Image::Lock s_samplesLock;
+
+//-*****************************************************************************
+
+bool SampleKey::operator<(const SampleKey& other) const
+{
+	if (index != other.index)
+		return index < other.index;
+	if (property != other.property)
+		return property < other.property;
+	return archive < other.archive;
+}
+
+//-*****************************************************************************
+
+static size_t getBudgetBytes()
+{
+	if (!s_budgetSet) {
+		size_t megabytes = DEFAULT_SAMPLE_CACHE_MB;
+		const char* env = getenv("ABCNUKE_SAMPLE_CACHE_MB");
+		if (env && env[0] != '\0') {
+			megabytes = atol(env);
+		}
+		s_budget = megabytes * 1024 * 1024;
+		s_budgetSet = true;
+	}
+	return s_budget;
+}
+
+// Drop least recently used samples until we're within budget
+static void evict()
+{
+	size_t budget = getBudgetBytes();
+	while (s_bytes > budget && !s_samples.empty()) {
+		s_bytes -= s_samples.back().bytes;
+		s_sampleMap.erase(s_samples.back().key);
+		s_samples.pop_back();
+	}
+}
+
+//-*****************************************************************************
+
+Alembic::AbcCoreAbstract::ArraySamplePtr findCachedSample(const SampleKey& key)
+{
+	DD::Image::Guard guard(s_samplesLock);
+
+	SampleMap::iterator it = s_sampleMap.find(key);
+	if (it == s_sampleMap.end())
+		return Alembic::AbcCoreAbstract::ArraySamplePtr();
+
+	// Move to the front
+	s_samples.splice(s_samples.begin(), s_samples, it->second);
+	return it->second->sample;
+}
+
+//-*****************************************************************************
+
+void addCachedSample(const SampleKey& key, Alembic::AbcCoreAbstract::ArraySamplePtr sample)
+{
+	if (!sample)
+		return;
+
+	size_t bytes = sample->size() * sample->getDataType().getNumBytes();
+
+	DD::Image::Guard guard(s_samplesLock);
+
+	if (bytes > getBudgetBytes())
+		return;
+
+	// Another thread might have read it in the meantime
+	SampleMap::iterator it = s_sampleMap.find(key);
+	if (it != s_sampleMap.end()) {
+		s_samples.splice(s_samples.begin(), s_samples, it->second);
+		return;
+	}
+
+	SampleEntry entry;
+	entry.key = key;
+	entry.sample = sample;
+	entry.bytes = bytes;
+	s_samples.push_front(entry);
+	s_sampleMap[key] = s_samples.begin();
+	s_bytes += bytes;
+
+	evict();
+}
+
+//-*****************************************************************************
+
+void clearCachedSamples(const std::string& archive)
+{
+	DD::Image::Guard guard(s_samplesLock);
+
+	SampleList::iterator it = s_samples.begin();
+	while (it != s_samples.end()) {
+		if (it->key.archive == archive) {
+			s_bytes -= it->bytes;
+			s_sampleMap.erase(it->key);
+			it = s_samples.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+}
+
+//-*****************************************************************************
+
+SampleKey getSampleKey(const IArrayProperty& prop, Alembic::AbcCoreAbstract::index_t index)
+{
+	SampleKey key;
+
+	IObject obj = prop.getObject();
+	key.archive = obj.getArchive().getName();
+
+	// Property names are only unique within their parent compound, so use the full path
+	std::string path = prop.getName();
+	ICompoundProperty parent = prop.getParent();
+	while (parent.valid() && !parent.getName().empty()) {
+		path = parent.getName() + "/" + path;
+		parent = parent.getParent();
+	}
+	key.property = obj.getFullName() + "/" + path;
+	key.index = index;
+
+	return key;
+}
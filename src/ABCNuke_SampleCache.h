@@ -0,0 +1,100 @@
+/*
+Copyright (c) 2011, Ivan Busquets
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+ * Neither the name of Ivan Busquets nor the names of its contributors may
+   be used to endorse or promote products derived from this software without
+   specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _ABCNuke_SampleCache_h_
+#define _ABCNuke_SampleCache_h_
+
+//-*****************************************************************************
+#include <Alembic/Abc/All.h>
+//-*****************************************************************************
+
+#include <algorithm>
+#include <string>
+
+using namespace Alembic::Abc;
+
+// A process-wide LRU cache of decoded array samples (positions, face indices,
+// UVs, normals...), keyed by archive, object, property and sample index.
+// Scrubbing back to a frame we've already read then needs no Alembic I/O.
+// The cache holds on to the samples, and evicts the least recently used ones
+// once the total size goes over budget.
+
+// Default budget in MB, if not set with $ABCNUKE_SAMPLE_CACHE_MB
+#define DEFAULT_SAMPLE_CACHE_MB 2048
+
+struct SampleKey
+{
+	std::string archive;     // archive file name
+	std::string property;    // full object name + property path
+	Alembic::AbcCoreAbstract::index_t index;
+
+	bool operator<(const SampleKey& other) const;
+};
+
+// Look up a sample. Returns an empty pointer if it's not there.
+Alembic::AbcCoreAbstract::ArraySamplePtr findCachedSample(const SampleKey& key);
+
+// Add a sample, evicting older ones if we go over budget
+void addCachedSample(const SampleKey& key, Alembic::AbcCoreAbstract::ArraySamplePtr sample);
+
+// Drop every sample from an archive (e.g. when the file changed on disk)
+void clearCachedSamples(const std::string& archive);
+
+// Key for sample 'index' of a property
+SampleKey getSampleKey(const IArrayProperty& prop, Alembic::AbcCoreAbstract::index_t index);
+
+//-*****************************************************************************
+
+// Read sample 'index' of a typed array property, going through the cache
+template <class PROPERTY>
+typename PROPERTY::sample_ptr_type getCachedSample(PROPERTY prop, Alembic::AbcCoreAbstract::index_t index)
+{
+	typename PROPERTY::sample_ptr_type sample;
+
+	size_t numSamples = prop.getNumSamples();
+	if (numSamples == 0)
+		return sample;
+
+	index = std::max(Alembic::AbcCoreAbstract::index_t(0),
+			std::min(index, Alembic::AbcCoreAbstract::index_t(numSamples - 1)));
+
+	SampleKey key = getSampleKey(prop, index);
+
+	Alembic::AbcCoreAbstract::ArraySamplePtr cached = findCachedSample(key);
+	if (cached) {
+		return Alembic::Util::static_pointer_cast<typename PROPERTY::sample_type>(cached);
+	}
+
+	prop.get(sample, ISampleSelector(index));
+	addCachedSample(key, sample);
+
+	return sample;
+}
+
+#endif
@@ -0,0 +1,662 @@
+/*
+Copyright (c) 2011, Ivan Busquets
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+ * Neither the name of Ivan Busquets nor the names of its contributors may
+   be used to endorse or promote products derived from this software without
+   specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+//-*****************************************************************************
+#include "ABCNuke_SceneIndex.h"
+#include "ABCNuke_ArchiveHelper.h"
+#include "ABCNuke_GeoHelper.h"
+#include "ABCNuke_ThreadHelper.h"
+#include "DDImage/Thread.h"
+//-*****************************************************************************
+
+#include <fnmatch.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <sstream>
+
+using namespace Alembic::AbcGeom;
+
+// How often getSceneIndex checks on a background scan, in microseconds
+#define SCAN_POLL_INTERVAL 10000
+
+// Subtrees to split the hierarchy into per thread, so threads that get
+// small ones can pick up more
+#define SUBTREES_PER_THREAD 8
+
+// An index being built on a background thread
+struct SceneScan
+{
+	IArchive archive;
+	AtomicValue<bool> cancelled;
+	AtomicValue<size_t> numVisited;
+	int numWaiting;  // nodes waiting for it. Guarded by indicesLock().
+};
+
+struct IndexEntry
+{
+	Alembic::Util::weak_ptr<Alembic::AbcCoreAbstract::ArchiveReader> reader;
+	Alembic::Util::weak_ptr<SceneIndex> index;
+	SceneIndexPtr pending;  // built by a scan, held until somebody asks for it
+	SceneScanPtr scan;      // still being built
+};
+
+// Keyed by archive reader. The weak reference to the reader tells a reused
+// address apart from the archive the index was built for.
+typedef std::map<const Alembic::AbcCoreAbstract::ArchiveReader*, IndexEntry> IndexMap;
+
+// Never destroyed, so scans still running when Nuke exits don't touch a dead map
+static IndexMap& indices()
+{
+	static IndexMap* s_indices = new IndexMap;
+	return *s_indices;
+}
+
+static DD::Image::Lock& indicesLock()
+{
+	static DD::Image::Lock* s_indicesLock = new DD::Image::Lock;
+	return *s_indicesLock;
+}
+
+//-*****************************************************************************
+
+template <class SCHEMA>
+static void setSchemaSampling(SceneObject& obj, const SCHEMA& schema)
+{
+	obj.timeSampling = schema.getTimeSampling();
+	obj.numSamples = schema.getNumSamples();
+	obj.constant = schema.isConstant();
+}
+
+// Same span as getObjectTimeSpan()
+static void addTimeSpan(SceneIndex& index, const SceneObject& obj)
+{
+	if (!obj.timeSampling || obj.numSamples == 0)
+		return;
+
+	const chrono_t first = obj.timeSampling->getSampleTime(0);
+	const chrono_t last = obj.constant ? first : obj.timeSampling->getSampleTime(obj.numSamples - 1);
+	index.firstTime = std::min(index.firstTime, first);
+	index.lastTime = std::max(index.lastTime, last);
+}
+
+//-*****************************************************************************
+
+// Everything about iObj itself, without looking at its children
+static SceneObject describeObject(IObject iObj, int parent, bool parentAnimated)
+{
+	const ObjectHeader& header = iObj.getHeader();
+
+	SceneObject obj;
+	obj.object = iObj;
+	obj.path = iObj.getFullName();
+	obj.id = 0;  // set once the index is put together
+	obj.type = kOtherObject;
+	obj.parent = parent;
+	obj.numSamples = 0;
+	obj.constant = true;
+	obj.parentAnimated = parentAnimated;
+	obj.topologyChanging = false;
+	obj.attributesAnimated = false;
+	obj.pointsAnimated = false;
+
+	if (IPolyMesh::matches(header)) {
+		IPolyMesh iPoly(iObj, kWrapExisting);
+		IPolyMeshSchema mesh = iPoly.getSchema();
+		obj.type = kPolyMeshObject;
+		setSchemaSampling(obj, mesh);
+		obj.topologyChanging = mesh.getTopologyVariance() == kHeterogenousTopology;
+	}
+	else if (ISubD::matches(header)) {
+		ISubD iSub(iObj, kWrapExisting);
+		ISubDSchema mesh = iSub.getSchema();
+		obj.type = kSubDObject;
+		setSchemaSampling(obj, mesh);
+		obj.topologyChanging = mesh.getTopologyVariance() == kHeterogenousTopology;
+	}
+	else if (IXform::matches(header)) {
+		IXform iXf(iObj, kWrapExisting);
+		obj.type = kXformObject;
+		setSchemaSampling(obj, iXf.getSchema());
+	}
+	else if (ICamera::matches(header)) {
+		ICamera iCam(iObj, kWrapExisting);
+		obj.type = kCameraObject;
+		setSchemaSampling(obj, iCam.getSchema());
+	}
+
+	if (obj.isGeo()) {
+		obj.attributesAnimated = obj.topologyChanging || isAttributeAnimated(iObj);
+		obj.pointsAnimated = obj.topologyChanging || !obj.constant || obj.parentAnimated;
+	}
+
+	return obj;
+}
+
+// Same as isConcatMatrixAnimated() for the children of obj, without walking up the hierarchy again
+static bool isAnimatedParent(const SceneObject& obj)
+{
+	return obj.parentAnimated || (obj.type == kXformObject && !obj.constant);
+}
+
+// Returns false if the scan got cancelled
+static bool visitObject(SceneScan* scan)
+{
+	if (!scan)
+		return true;
+	if (scan->cancelled.load())
+		return false;
+
+	scan->numVisited.add(1);  // subtrees are scanned on several threads
+	return true;
+}
+
+//-*****************************************************************************
+
+static void addObject(SceneIndex& index, IObject iObj, int parent, bool parentAnimated, SceneScan* scan)
+{
+	if (!visitObject(scan))
+		return;
+
+	const SceneObject obj = describeObject(iObj, parent, parentAnimated);
+
+	const int self = index.objects.size();
+	if (obj.isGeo()) {
+		index.geos.push_back(self);
+	}
+	addTimeSpan(index, obj);
+	index.objects.push_back(obj);
+
+	const bool animated = isAnimatedParent(obj);
+	const size_t numChildren = iObj.getNumChildren();
+	for (size_t i = 0; i < numChildren; i++) {
+		addObject(index, iObj.getChild(i), self, animated, scan);
+	}
+}
+
+//-*****************************************************************************
+
+// A node at the top of the hierarchy. The top levels are described on one
+// thread, until there are enough subtrees under them to keep all threads busy.
+// Then each subtree is scanned into an index of its own, in parallel.
+struct ScanNode
+{
+	IObject object;
+	bool parentAnimated;
+	bool expanded;                   // described here, and its children are nodes too
+	SceneObject obj;                 // if expanded
+	std::vector<unsigned> children;  // if expanded
+	SceneIndex subtree;              // otherwise
+};
+
+struct SubtreeJob
+{
+	std::vector<ScanNode>* nodes;
+	const std::vector<unsigned>* subtrees;
+	SceneScan* scan;
+};
+
+static void scanSubtrees(size_t begin, size_t end, void* d)
+{
+	SubtreeJob* job = (SubtreeJob*)d;
+
+	for (size_t i = begin; i < end; i++) {
+		ScanNode& node = (*job->nodes)[(*job->subtrees)[i]];
+		node.subtree.firstTime = std::numeric_limits<chrono_t>::max();
+		node.subtree.lastTime = -std::numeric_limits<chrono_t>::max();
+		addObject(node.subtree, node.object, -1, node.parentAnimated, job->scan);
+	}
+}
+
+static unsigned addNode(std::vector<ScanNode>& nodes, IObject object, bool parentAnimated)
+{
+	ScanNode node;
+	node.object = object;
+	node.parentAnimated = parentAnimated;
+	node.expanded = false;
+	nodes.push_back(node);
+	return nodes.size() - 1;
+}
+
+// Append node n and everything under it to index, in the same depth first
+// order a single-threaded walk would, so object indices don't depend on timing
+static void mergeNode(SceneIndex& index, std::vector<ScanNode>& nodes, unsigned n, int parent)
+{
+	ScanNode& node = nodes[n];
+
+	if (node.expanded) {
+		SceneObject obj = node.obj;
+		obj.parent = parent;
+
+		const int self = index.objects.size();
+		if (obj.isGeo()) {
+			index.geos.push_back(self);
+		}
+		addTimeSpan(index, obj);
+		index.objects.push_back(obj);
+
+		for (size_t i = 0; i < node.children.size(); i++) {
+			mergeNode(index, nodes, node.children[i], self);
+		}
+		return;
+	}
+
+	// Subtree indices start at 0, with the root under the archive's top
+	const int offset = index.objects.size();
+	for (size_t i = 0; i < node.subtree.objects.size(); i++) {
+		SceneObject obj = node.subtree.objects[i];
+		obj.parent = obj.parent < 0 ? parent : obj.parent + offset;
+		index.objects.push_back(obj);
+	}
+	for (size_t i = 0; i < node.subtree.geos.size(); i++) {
+		index.geos.push_back(node.subtree.geos[i] + offset);
+	}
+	if (!node.subtree.objects.empty()) {
+		index.firstTime = std::min(index.firstTime, node.subtree.firstTime);
+		index.lastTime = std::max(index.lastTime, node.subtree.lastTime);
+	}
+
+	std::vector<SceneObject>().swap(node.subtree.objects);
+}
+
+//-*****************************************************************************
+
+// Returns NULL if scan gets cancelled
+static SceneIndexPtr buildSceneIndex(IArchive archive, SceneScan* scan = NULL)
+{
+	SceneIndexPtr index(new SceneIndex);
+	index->archive = archive.getPtr();
+	index->firstTime = std::numeric_limits<chrono_t>::max();
+	index->lastTime = -std::numeric_limits<chrono_t>::max();
+
+	IObject archiveTop = archive.getTop();
+	const unsigned numThreads = getNumThreads(0);
+
+	// Reading headers is mostly waiting on the archive, so subtrees are walked on
+	// several threads at once. Their indices are merged in hierarchy order after.
+	std::vector<ScanNode> nodes;
+	std::vector<unsigned> roots;
+	for (size_t i = 0; i < archiveTop.getNumChildren(); i++) {
+		roots.push_back(addNode(nodes, archiveTop.getChild(i), false));
+	}
+
+	// Describe the top of the hierarchy a level at a time, until there are enough subtrees
+	std::vector<unsigned> subtrees(roots);
+	while (numThreads > 1 && subtrees.size() < numThreads * SUBTREES_PER_THREAD) {
+		std::vector<unsigned> next;
+		for (size_t i = 0; i < subtrees.size(); i++) {
+			const unsigned n = subtrees[i];
+			if (!visitObject(scan))
+				return SceneIndexPtr();
+
+			nodes[n].expanded = true;
+			nodes[n].obj = describeObject(nodes[n].object, -1, nodes[n].parentAnimated);
+
+			const bool animated = isAnimatedParent(nodes[n].obj);
+			const size_t numChildren = nodes[n].object.getNumChildren();
+			for (size_t c = 0; c < numChildren; c++) {
+				IObject child = nodes[n].object.getChild(c);
+				const unsigned childNode = addNode(nodes, child, animated);  // may move nodes[n]
+				nodes[n].children.push_back(childNode);
+				next.push_back(childNode);
+			}
+		}
+		subtrees.swap(next);
+		if (subtrees.empty())  // nothing left to split
+			break;
+	}
+
+	SubtreeJob job;
+	job.nodes = &nodes;
+	job.subtrees = &subtrees;
+	job.scan = scan;
+	parallelFor(subtrees.size(), 1, numThreads, scanSubtrees, &job);
+
+	if (scan && scan->cancelled.load())
+		return SceneIndexPtr();
+
+	for (size_t i = 0; i < roots.size(); i++) {
+		mergeNode(*index, nodes, roots[i], -1);
+	}
+	for (size_t i = 0; i < index->objects.size(); i++) {
+		index->objects[i].id = i;
+	}
+
+	// The archive's own bounds have the span of everything, if it wrote them
+	if (archiveTop.getProperties().getPropertyHeader(".childBnds") != NULL) {
+		chrono_t first = std::numeric_limits<chrono_t>::max();
+		chrono_t last = -std::numeric_limits<chrono_t>::max();
+		getABCTimeSpan(archive, first, last);
+		index->firstTime = first;
+		index->lastTime = last;
+	}
+
+	if (index->firstTime > index->lastTime) {  // nothing has samples
+		index->firstTime = index->lastTime = 0;
+	}
+
+	return index;
+}
+
+//-*****************************************************************************
+
+// The entry of reader, if it's still there. Call with indicesLock() held.
+static IndexEntry* findEntry(Alembic::AbcCoreAbstract::ArchiveReaderPtr reader)
+{
+	IndexMap::iterator it = indices().find(reader.get());
+	if (it == indices().end())
+		return NULL;
+
+	if (it->second.reader.lock() != reader) {  // a reused address
+		indices().erase(it);
+		return NULL;
+	}
+
+	return &it->second;
+}
+
+// Drop indices nobody uses anymore. Call with indicesLock() held.
+static void dropUnusedEntries()
+{
+	IndexMap::iterator it = indices().begin();
+	while (it != indices().end()) {
+		if (it->second.index.expired() && !it->second.scan) {
+			indices().erase(it++);
+		}
+		else {
+			++it;
+		}
+	}
+}
+
+//-*****************************************************************************
+
+// Let others know the index of archive is being built. Call with indicesLock() held.
+static SceneScanPtr registerScan(IArchive archive)
+{
+	dropUnusedEntries();
+
+	SceneScanPtr scan(new SceneScan);
+	scan->archive = archive;
+	scan->numWaiting = 0;
+
+	Alembic::AbcCoreAbstract::ArchiveReaderPtr reader = archive.getPtr();
+	IndexEntry& entry = indices()[reader.get()];
+	entry.reader = reader;
+	entry.index.reset();
+	entry.pending.reset();
+	entry.scan = scan;
+
+	return scan;
+}
+
+// Hand out the index a scan built, unless it was cancelled (or replaced) in the meantime.
+// Indices nobody has asked for yet are held until somebody does.
+static void finishScan(SceneScanPtr scan, SceneIndexPtr index, bool hold)
+{
+	DD::Image::Guard guard(indicesLock());
+
+	IndexEntry* entry = findEntry(scan->archive.getPtr());
+	if (entry && entry->scan == scan) {
+		entry->scan.reset();
+		if (index) {
+			entry->index = index;
+			if (hold) {
+				entry->pending = index;
+			}
+		}
+	}
+}
+
+static void* runScan(void* d)
+{
+	SceneScanPtr* scanPtr = (SceneScanPtr*)d;
+	SceneScanPtr scan = *scanPtr;
+	delete scanPtr;
+
+	finishScan(scan, buildSceneIndex(scan->archive, scan.get()), true);
+	return NULL;
+}
+
+//-*****************************************************************************
+
+SceneScanPtr startSceneIndexScan(IArchive archive)
+{
+	if (!archive.valid())
+		return SceneScanPtr();
+
+	DD::Image::Guard guard(indicesLock());
+
+	IndexEntry* entry = findEntry(archive.getPtr());
+	if (entry && !entry->index.expired())
+		return SceneScanPtr();
+
+	// Somebody else is scanning it already. Wait for the same scan.
+	if (entry && entry->scan) {
+		entry->scan->numWaiting++;
+		return entry->scan;
+	}
+
+	SceneScanPtr scan = registerScan(archive);
+	scan->numWaiting = 1;
+
+	// The thread holds on to the scan until it's done
+	pthread_t thread;
+	SceneScanPtr* arg = new SceneScanPtr(scan);
+	if (pthread_create(&thread, NULL, runScan, arg) != 0) {
+		delete arg;
+		indices()[archive.getPtr().get()].scan.reset();
+		return SceneScanPtr();
+	}
+
+	pthread_detach(thread);
+	return scan;
+}
+
+//-*****************************************************************************
+
+void releaseSceneIndexScan(SceneScanPtr scan)
+{
+	if (!scan)
+		return;
+
+	DD::Image::Guard guard(indicesLock());
+
+	if (--scan->numWaiting > 0)
+		return;
+
+	// Nobody wants it anymore. Stop it if it's still going.
+	IndexEntry* entry = findEntry(scan->archive.getPtr());
+	if (entry && entry->scan == scan) {
+		scan->cancelled.store(true);
+		entry->scan.reset();
+		entry->pending.reset();
+	}
+}
+
+//-*****************************************************************************
+
+SceneIndexPtr findSceneIndex(IArchive archive, bool* scanning, size_t* numVisited)
+{
+	if (scanning) *scanning = false;
+	if (numVisited) *numVisited = 0;
+
+	if (!archive.valid())
+		return SceneIndexPtr();
+
+	DD::Image::Guard guard(indicesLock());
+
+	IndexEntry* entry = findEntry(archive.getPtr());
+	if (!entry)
+		return SceneIndexPtr();
+
+	SceneIndexPtr index = entry->index.lock();
+	if (index) {
+		entry->pending.reset();  // the caller holds on to it now
+		return index;
+	}
+
+	if (entry->scan) {
+		if (scanning) *scanning = true;
+		if (numVisited) *numVisited = entry->scan->numVisited.load();
+	}
+
+	return SceneIndexPtr();
+}
+
+//-*****************************************************************************
+
+SceneIndexPtr getSceneIndex(IArchive archive)
+{
+	if (!archive.valid())
+		return SceneIndexPtr();
+
+	for (;;) {
+		// Let a scan in progress finish, rather than walking the archive twice
+		bool scanning = false;
+		SceneIndexPtr index = findSceneIndex(archive, &scanning);
+		if (index)
+			return index;
+		if (scanning) {
+			usleep(SCAN_POLL_INTERVAL);
+			continue;
+		}
+
+		// Nobody is building it. Build it here, as a scan others can wait for,
+		// without holding the lock.
+		SceneScanPtr scan;
+		{
+			DD::Image::Guard guard(indicesLock());
+			IndexEntry* entry = findEntry(archive.getPtr());
+			if (entry && (entry->scan || !entry->index.expired()))
+				continue;  // somebody got there first
+			scan = registerScan(archive);
+			scan->numWaiting = 1;  // never released, so it can't be cancelled
+		}
+
+		index = buildSceneIndex(archive, scan.get());
+		finishScan(scan, index, false);
+		if (index)
+			return index;
+	}
+}
+
+//-*****************************************************************************
+
+static std::vector<std::string> splitPatterns(const std::string& patterns)
+{
+	std::vector<std::string> result;
+	std::istringstream stream(patterns);
+	std::string pattern;
+	while (stream >> pattern) {
+		result.push_back(pattern);
+	}
+	return result;
+}
+
+static bool matchesAny(const std::vector<std::string>& patterns, const std::string& path)
+{
+	for (size_t i = 0; i < patterns.size(); i++) {
+		if (fnmatch(patterns[i].c_str(), path.c_str(), 0) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+//-*****************************************************************************
+
+bool isFilterEmpty(const std::string& include, const std::string& exclude)
+{
+	const std::vector<std::string> includes = splitPatterns(include);
+	for (size_t i = 0; i < includes.size(); i++) {
+		if (includes[i] != "*") {
+			return false;
+		}
+	}
+	return splitPatterns(exclude).empty();
+}
+
+//-*****************************************************************************
+
+SceneIndexPtr filterSceneIndex(SceneIndexPtr index, const std::string& include, const std::string& exclude)
+{
+	if (!index || isFilterEmpty(include, exclude))
+		return index;
+
+	const std::vector<std::string> includes = splitPatterns(include);
+	const std::vector<std::string> excludes = splitPatterns(exclude);
+	const size_t numObjects = index->objects.size();
+
+	// Parents come before their children, so one pass sees excluded parents first
+	std::vector<bool> excluded(numObjects, false);
+	std::vector<bool> selected(numObjects, false);
+	for (size_t i = 0; i < numObjects; i++) {
+		const SceneObject& obj = index->objects[i];
+		excluded[i] = (obj.parent >= 0 && excluded[obj.parent]) || matchesAny(excludes, obj.path);
+		selected[i] = obj.isGeo() && !excluded[i] && (includes.empty() || matchesAny(includes, obj.path));
+	}
+
+	// Selected meshes still need their parents, for their transforms
+	std::vector<bool> keep(selected);
+	for (unsigned g = 0; g < index->numGeos(); g++) {
+		int i = index->geos[g];
+		if (!selected[i])
+			continue;
+
+		for (int p = index->objects[i].parent; p >= 0 && !keep[p]; p = index->objects[p].parent) {
+			keep[p] = true;
+		}
+	}
+
+	// Copy what's left, in the same order, pointing at the new parent indices
+	SceneIndexPtr filtered(new SceneIndex);
+	filtered->archive = index->archive;
+	filtered->firstTime = index->firstTime;
+	filtered->lastTime = index->lastTime;
+
+	std::vector<int> remap(numObjects, -1);
+	for (size_t i = 0; i < numObjects; i++) {
+		if (!keep[i])
+			continue;
+
+		SceneObject obj = index->objects[i];
+		obj.parent = obj.parent >= 0 ? remap[obj.parent] : -1;
+
+		remap[i] = filtered->objects.size();
+		if (selected[i]) {
+			filtered->geos.push_back(filtered->objects.size());
+		}
+		filtered->objects.push_back(obj);
+	}
+
+	return filtered;
+}
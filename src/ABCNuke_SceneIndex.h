@@ -0,0 +1,117 @@
+/*
+Copyright (c) 2011, Ivan Busquets
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+ * Neither the name of Ivan Busquets nor the names of its contributors may
+   be used to endorse or promote products derived from this software without
+   specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _ABCNuke_SceneIndex_h_
+#define _ABCNuke_SceneIndex_h_
+
+//-*****************************************************************************
+#include <Alembic/Abc/All.h>
+#include <Alembic/AbcGeom/All.h>
+//-*****************************************************************************
+
+#include <string>
+#include <vector>
+
+using namespace Alembic::AbcGeom;
+
+enum SceneObjectType
+{
+	kOtherObject,
+	kXformObject,
+	kPolyMeshObject,
+	kSubDObject,
+	kCameraObject
+};
+
+// Everything we need to know about an object without looking at its headers again
+struct SceneObject
+{
+	IObject object;
+	std::string path;               // full name in the archive
+	unsigned id;                    // position in the archive's full index. Filtered indices keep it.
+	SceneObjectType type;
+	int parent;                     // index of the parent, -1 under the archive's top
+	TimeSamplingPtr timeSampling;   // of the schema. NULL for unknown types
+	size_t numSamples;
+	bool constant;                  // the schema has a single sample
+	bool parentAnimated;            // some parent xform is animated
+	bool topologyChanging;          // heterogenous mesh topology
+	bool attributesAnimated;        // UVs or normals change over time
+	bool pointsAnimated;            // world space points change over time
+
+	bool isGeo() const { return type == kPolyMeshObject || type == kSubDObject; }
+};
+
+// The hierarchy of an archive, walked once and shared by every node reading it.
+// Objects are stored depth first, so parents always come before their children.
+struct SceneIndex
+{
+	Alembic::AbcCoreAbstract::ArchiveReaderPtr archive;
+	std::vector<SceneObject> objects;
+	std::vector<unsigned> geos;     // IPolyMeshes and ISubDs, in hierarchy order
+	chrono_t firstTime;             // span of all the samples in the archive
+	chrono_t lastTime;
+
+	unsigned numGeos() const { return geos.size(); }
+	const SceneObject& geo(unsigned i) const { return objects[geos[i]]; }
+};
+
+typedef Alembic::Util::shared_ptr<SceneIndex> SceneIndexPtr;
+
+// Get the index of an archive. It's built the first time it's asked for, and
+// kept for as long as somebody holds on to it. A reopened archive gets a new one.
+// If it's being scanned in the background, this waits for the scan to finish.
+SceneIndexPtr getSceneIndex(IArchive archive);
+
+struct SceneScan;
+typedef Alembic::Util::shared_ptr<SceneScan> SceneScanPtr;
+
+// Build the index of an archive on a background thread. Walking a big archive
+// can take a long time. Nodes asking for the same archive share one scan.
+// Returns the scan the caller now waits for, or NULL if the index is built already.
+SceneScanPtr startSceneIndexScan(IArchive archive);
+
+// Stop waiting for a scan, once it's done or no longer wanted. The scan is
+// cancelled when nobody waits for it anymore. Whoever needs the index
+// afterwards builds it with getSceneIndex.
+void releaseSceneIndexScan(SceneScanPtr scan);
+
+// The index of an archive if it's been built, without waiting or building it.
+// Otherwise, scanning tells if it's being built, and numVisited how many
+// objects the scan has gone through so far.
+SceneIndexPtr findSceneIndex(IArchive archive, bool* scanning = NULL, size_t* numVisited = NULL);
+
+// Only the meshes whose full path matches one of the include patterns, and
+// neither it nor any of its parents match an exclude pattern, along with their
+// parents. Patterns are space separated globs, like "/city/block_*/tree*".
+// The index itself is returned if the patterns let everything through.
+SceneIndexPtr filterSceneIndex(SceneIndexPtr index, const std::string& include, const std::string& exclude);
+bool isFilterEmpty(const std::string& include, const std::string& exclude);
+
+#endif
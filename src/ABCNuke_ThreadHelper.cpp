@@ -0,0 +1,130 @@
+/*
+Copyright (c) 2011, Ivan Busquets
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+ * Neither the name of Ivan Busquets nor the names of its contributors may
+   be used to endorse or promote products derived from this software without
+   specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+//-*****************************************************************************
+#include "ABCNuke_ThreadHelper.h"
+#include "DDImage/Thread.h"
+//-*****************************************************************************
+
+#include <algorithm>
+
+using namespace DD::Image;
+
+struct ParallelForJob
+{
+	RangeFunction* fn;
+	void* userdata;
+	size_t count;
+	size_t grain;
+	size_t next;    // first item not handed out yet
+	Lock lock;
+};
+
+// Set while a thread is running parallelFor work, so nested calls know they're nested
+static __thread bool s_inParallelFor = false;
+
+// Number of parallelFor threads that still have work to do. Nested calls only
+// spawn threads for the CPUs the others have left idle.
+static AtomicValue<int> s_busyThreads;
+
+//-*****************************************************************************
+
+static void parallelForThread(unsigned index, unsigned nThreads, void* d)
+{
+	ParallelForJob* job = (ParallelForJob*)d;
+
+	s_inParallelFor = true;
+	s_busyThreads.add(1);
+
+	for (;;) {
+		size_t begin, end;
+		{
+			Guard guard(job->lock);
+			if (job->next >= job->count)
+				break;
+			begin = job->next;
+			end = std::min(begin + job->grain, job->count);
+			job->next = end;
+		}
+		job->fn(begin, end, job->userdata);
+	}
+
+	s_busyThreads.add(-1);
+	s_inParallelFor = false;
+}
+
+//-*****************************************************************************
+
+unsigned getNumThreads(unsigned requested)
+{
+	if (requested > 0)
+		return requested;
+	return std::max(Thread::numCPUs, 1u);
+}
+
+//-*****************************************************************************
+
+void parallelFor(size_t count, size_t grain, unsigned numThreads, RangeFunction* fn, void* userdata)
+{
+	if (count == 0)
+		return;
+
+	grain = std::max(grain, size_t(1));
+	size_t numChunks = (count + grain - 1) / grain;
+	numThreads = (unsigned)std::min(size_t(getNumThreads(numThreads)), numChunks);
+
+	// Inside another parallelFor, this thread waits for the new ones, so it can
+	// hand its CPU over to them, along with any the outer loop isn't using anymore
+	const bool nested = s_inParallelFor;
+	if (nested) {
+		int idle = int(getNumThreads(0)) - s_busyThreads.load() + 1;
+		numThreads = (unsigned)std::max(std::min(int(numThreads), idle), 1);
+	}
+
+	if (numThreads <= 1) {
+		fn(0, count, userdata);
+		return;
+	}
+
+	ParallelForJob job;
+	job.fn = fn;
+	job.userdata = userdata;
+	job.count = count;
+	job.grain = grain;
+	job.next = 0;
+
+	if (nested)
+		s_busyThreads.add(-1);
+
+	Thread::spawn(parallelForThread, numThreads, &job);
+	Thread::wait(&job);
+
+	if (nested)
+		s_busyThreads.add(1);
+}
@@ -0,0 +1,70 @@
+/*
+Copyright (c) 2011, Ivan Busquets
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+ * Neither the name of Ivan Busquets nor the names of its contributors may
+   be used to endorse or promote products derived from this software without
+   specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _ABCNuke_ThreadHelper_h_
+#define _ABCNuke_ThreadHelper_h_
+
+#include <cstddef>
+
+// Function run on a range [begin, end) of work items
+typedef void (RangeFunction)(size_t begin, size_t end, void* userdata);
+
+// Number of threads to use when the user asks for 'requested' (0 means one per CPU)
+unsigned getNumThreads(unsigned requested);
+
+// Run fn over the work items [0, count), on up to numThreads threads.
+// Items are handed out in chunks of 'grain', so threads that finish early pick
+// up more work. Runs on the calling thread if there's only one chunk of work
+// (or one thread), so small jobs don't pay for spawning threads. When called from
+// inside another parallelFor, only uses the CPUs the outer loop has left idle
+// (e.g. a big mesh still converting after the other objects are done), so nested
+// loops don't oversubscribe the CPUs.
+void parallelFor(size_t count, size_t grain, unsigned numThreads, RangeFunction* fn, void* userdata);
+
+// A value shared between threads, read and written without a lock.
+// (GCC atomic builtins, for want of std::atomic)
+template <class T>
+class AtomicValue
+{
+public:
+	AtomicValue(T value = T()) : m_value(value) {}
+
+	T load() const { return __atomic_load_n(&m_value, __ATOMIC_ACQUIRE); }
+	void store(T value) { __atomic_store_n(&m_value, value, __ATOMIC_RELEASE); }
+	// Returns the new value
+	T add(T amount) { return __atomic_add_fetch(&m_value, amount, __ATOMIC_ACQ_REL); }
+
+private:
+	AtomicValue(const AtomicValue&);
+	AtomicValue& operator=(const AtomicValue&);
+
+	T m_value;
+};
+
+#endif
@@ -16,26 +16,31 @@
 
 
 // Alembic headers
-#include "Alembic/AbcCoreHDF5/All.h"
 #include "Alembic/AbcGeom/All.h"
 #include "Alembic/Abc/All.h"
 
 // ABCNuke helpers
+#include "ABCNuke_ArchiveCache.h"
 #include "ABCNuke_ArchiveHelper.h"
 #include "ABCNuke_GeoHelper.h"
 #include "ABCNuke_MatrixHelper.h"
+#include "ABCNuke_Prefetcher.h"
+#include "ABCNuke_SampleCache.h"
+#include "ABCNuke_SceneIndex.h"
+#include "ABCNuke_ThreadHelper.h"
 
 // std libs
+#include <cmath>
 #include <iostream>
-
-
-#define _FPS 24.0  // Hard code a base of 24fps. Is there a way to get this from the project settings?
+#include <map>
+#include <sstream>
 
 using namespace DD::Image;
 using namespace Alembic::AbcGeom;
 
-static const char* const interpolation_types[] = { "off", "linear" , 0};
+static const char* const interpolation_types[] = { "off", "linear", "velocity", 0};
 static const char* const timing_types[] = { "original timing", "retime", 0};
+static const char* const primitive_types[] = { "polygons", "single mesh", 0};
 
 
 static const char* nodeClass = "ABCReadGeo";
@@ -45,45 +50,105 @@ static const char* const HELP = "Alembic geometry reader";
 class ABCReadGeo : public SourceGeo
 {
 	const char* 				m_filename;
+	const char*				m_include;
+	const char*				m_exclude;
 	unsigned 				m_version;
 	int 					interpolate;
 	IArchive 				archive;
 	Knob* 					p_tableKnob;
 	Table_KnobI* 				p_tableKnobI;
 	int					timing;
+	int					m_primitiveType;
+	bool					m_bakeXforms;
 	int					m_first;
 	int					m_last;
 	float					m_frame;
 	float					m_sampleFrame;
+	float					m_fps;
+	float					m_archiveFps;     // what we last set m_fps to from the archive, 0 if nothing yet
+	bool					m_fpsOverride;    // the user has set m_fps, so leave it alone
 	std::vector<bool>			active_objs;
 	std::vector<bool>			bbox_objs;
-	bool 					m_rebuild_all;
+	SceneIndexPtr				m_fullSceneIndex; // every object in the archive
+	SceneIndexPtr				m_sceneIndex;     // the ones that pass the path filter
+	SceneIndexPtr				m_tableIndex;     // the one the rows of the object list came from
+	std::string				m_filter;         // include and exclude patterns of m_sceneIndex
+	bool					m_scanPending;    // the object list waits for a background scan
+	SceneScanPtr				m_scan;           // the one we wait for, while it's going
+	bool					m_scanTiming;     // and so do the frame range knobs
+	int					m_readStreams;
+	bool					m_useMmap;
+	int					m_threads;
+	bool					m_prefetch;
+	int					m_prefetchFrames;
+	SamplePrefetcher*			m_prefetcher;   // only used on firstOp()
+	XformSampleCache			m_xformSamples; // only used on firstOp()
+	ConstantPointCache			m_constantPoints; // only used on firstOp()
+	std::vector<Hash>			m_pointHashes;    // per object, of the points in the GeometryList
+	std::vector<Hash>			m_newPointHashes; // per object, of the points at the current frame
+	SampleTimeCache				m_sampleTimes;    // sample lookups at the current frame
 
 
 public:
 	ABCReadGeo(Node* node): SourceGeo(node) {
 		m_filename = "";
+		m_include = "*";
+		m_exclude = "";
 		m_version = 0;
 		interpolate = 0;
 		p_tableKnob = NULL;
 		p_tableKnobI = NULL;
 		timing = 0;
+		m_primitiveType = 0;
+		m_bakeXforms = true;
 		m_first = m_last = 1;
 		m_frame = 1;
 		m_sampleFrame = 1;
+		m_fps = 24;
+		m_archiveFps = 0;
+		m_fpsOverride = false;
+
+		m_scanPending = false;
+		m_scanTiming = false;
+
+		// Defaults come from the environment, if set
+		ArchiveReadOptions options;
+		m_readStreams = options.numStreams;
+		m_useMmap = options.useMmap;
 
-		m_rebuild_all = true;
+		m_threads = 0;
 
+		m_prefetch = false;
+		m_prefetchFrames = 8;
+		m_prefetcher = NULL;
+
+	}
+
+	~ABCReadGeo() {
+		delete m_prefetcher;
+		releaseSceneIndexScan(m_scan);
 	}
 
 	virtual void knobs(Knob_Callback f);
 	int knob_changed(DD::Image::Knob* k);
+	bool updateUI(const OutputContext& context);
 	void _validate(bool for_real);
 	virtual const char* Class() const {return nodeClass;}
 	static const Op::Description description;
 
 	void updateTableKnob();
 	void updateTimingKnobs();
+	void startScan(bool timing);
+	bool updateScan();
+	void stopScan();
+	bool openArchive();
+	void updateSceneIndex(bool wait = false);
+	void updatePrefetch();
+	float getSampleFrame(double frame);
+	chrono_t getSampleTime(float sampleFrame) const;
+	void updateSampleTimes();
+	bool isStatic() const;
+	Hash getPointHash(unsigned obj) const;
 
 
 protected:
@@ -100,18 +165,44 @@ protected:
 // *****************************************************************************
 
 void ABCReadGeo::_validate(bool for_real)
+{
+	m_sampleFrame = getSampleFrame(outputContext().frame());
+
+	// The geometry hashes need to know which objects change topology or attributes
+	updateSceneIndex();
+	updateSampleTimes();
+
+	// Start reading upcoming frames during playback
+	updatePrefetch();
+
+	SourceGeo::_validate(for_real);
+
+}
+
+
+// *****************************************************************************
+// GETSAMPLEFRAME : Frame of the archive we sample from at a given output frame
+// *****************************************************************************
+
+float ABCReadGeo::getSampleFrame(double frame)
 {
 	// original timing
 	if (knob("timing")->get_value() == 0) {
-		m_sampleFrame = clamp(outputContext().frame(), m_first, m_last);
+		return clamp(frame, m_first, m_last);
 	}
 	//retime
 	else {
-		m_sampleFrame = clamp(knob("frame")->get_value_at(outputContext().frame()), m_first, m_last) ;
+		return clamp(knob("frame")->get_value_at(frame), m_first, m_last) ;
 	}
+}
 
-	SourceGeo::_validate(for_real);
+// *****************************************************************************
+// GETSAMPLETIME : Time in the archive of a sample frame
+// *****************************************************************************
 
+chrono_t ABCReadGeo::getSampleTime(float sampleFrame) const
+{
+	return sampleFrame / (m_fps > 0 ? m_fps : 24.0);
 }
 
 
@@ -124,6 +215,38 @@ void ABCReadGeo::knobs(Knob_Callback f)
 	// File knobs
 	File_knob(f, &m_filename, "file", "file", Geo_File);
 	Button(f, "Reload");
+	Button(f, "cancel_scan", "Cancel scan");
+	Tooltip(f, "Stop scanning the archive for objects.\n"
+			"Big archives are scanned in the background when the file changes, and the object list "
+			"is filled in when the scan is done. Press Reload to scan again.");
+	Named_Text_knob(f, "scan_status", "");
+
+	Int_knob(f, &m_readStreams, "read_streams", "read streams");
+	Tooltip(f, "Number of concurrent read streams for Ogawa archives.\n"
+			"More streams let several cooks read from the same archive at once.\n"
+			"Defaults to $ABCNUKE_OGAWA_STREAMS, if set. Ignored for HDF5 archives.");
+	SetRange(f, 1, 32);
+	Bool_knob(f, &m_useMmap, "use_mmap", "memory map");
+	Tooltip(f, "Memory map Ogawa archives instead of reading them with file streams.\n"
+			"Defaults to $ABCNUKE_OGAWA_MMAP, if set.");
+
+	Int_knob(f, &m_threads, "threads");
+	Tooltip(f, "Number of threads used to read objects from the archive,\n"
+			"and to convert the points, UVs and normals of very big meshes.\n"
+			"0 uses one thread per CPU.");
+	SetRange(f, 0, 64);
+
+	// The sample cache is shared by every node, so its budget comes from $ABCNUKE_SAMPLE_CACHE_MB
+	Obsolete_knob(f, "sample_cache", 0);
+
+	Bool_knob(f, &m_prefetch, "prefetch", "read ahead");
+	Tooltip(f, "During playback, read the samples of the next frames in the background.\n"
+			"Samples are kept in the sample cache.");
+	SetFlags(f, Knob::STARTLINE);
+	Int_knob(f, &m_prefetchFrames, "prefetch_frames", "frames");
+	Tooltip(f, "Number of frames to read ahead during playback.");
+	ClearFlags(f, Knob::STARTLINE);
+	SetRange(f, 1, 100);
 
 	// Set up the common SourceGeo knobs.
 	SourceGeo::knobs(f);
@@ -131,6 +254,12 @@ void ABCReadGeo::knobs(Knob_Callback f)
 	// Timing knobs
 	BeginGroup(f, "TimingGroup");
 	Enumeration_knob(f, &interpolate, interpolation_types, "interpolation");
+	Tooltip(f, "How to work out frames that fall between samples in the archive.\n"
+			"<b>off:</b> use the nearest sample.\n"
+			"<b>linear:</b> interpolate between the samples on either side.\n"
+			"<b>velocity:</b> move the points of the nearest sample along the mesh's velocities, "
+			"if it has them. Works for meshes with changing topology. "
+			"Transforms are still interpolated linearly.");
 
 	Enumeration_knob(f, &timing, timing_types, "timing");
 
@@ -143,6 +272,18 @@ void ABCReadGeo::knobs(Knob_Callback f)
 			"You can change this to clamp the animation to a smaller framerange\n");
 	ClearFlags(f, Knob::STARTLINE);
 
+	Float_knob(f, &m_fps, "fps");
+	Tooltip(f, "Frames per second of the Alembic archive. Frame f is read from time f/fps.\n"
+			"Set from the archive's time sampling when a file is loaded, unless you've changed it.\n"
+			"Set it back to the archive's frame rate to follow the archive again.");
+	SetRange(f, 1, 120);
+
+	// Saved with the script, so a reloaded script still knows where fps came from
+	Float_knob(f, &m_archiveFps, "archive_fps");
+	SetFlags(f, Knob::INVISIBLE);
+	Bool_knob(f, &m_fpsOverride, "fps_override");
+	SetFlags(f, Knob::INVISIBLE);
+
 	Float_knob(f, &m_frame, "frame");
 	Tooltip(f, "Frame the animation will be sampled from.\n"
 			"You can set this to a static frame, an animated curve,\n"
@@ -153,8 +294,28 @@ void ABCReadGeo::knobs(Knob_Callback f)
 
 	EndGroup(f);
 
+	Enumeration_knob(f, &m_primitiveType, primitive_types, "primitive_type", "primitives");
+	Tooltip(f, "How the faces of each mesh are output.\n"
+			"<b>polygons:</b> one polygon primitive per face.\n"
+			"<b>single mesh:</b> one mesh primitive per object. Much faster to build and render "
+			"for dense meshes. Meshes with points or lines are still output as polygons.");
+
+	Bool_knob(f, &m_bakeXforms, "bake_transforms", "bake transforms");
+	Tooltip(f, "Bake the transforms of the parents of each object into its points.\n"
+			"When off, points are kept in object space and the transform goes on the object's matrix, "
+			"so objects that only move don't need their points rebuilt on every frame.");
+
 	Divider(f);
 
+	// Path filter
+	String_knob(f, &m_include, "include");
+	Tooltip(f, "Only read the meshes whose full path in the archive matches one of these patterns.\n"
+			"Patterns are separated by spaces, and can use * ? and [] wildcards, like '/city/block_*/tree*'.\n"
+			"Meshes that don't match are left out of the object list and the output, and never read.");
+	String_knob(f, &m_exclude, "exclude");
+	Tooltip(f, "Leave out the objects whose full path matches one of these patterns, and everything under them.\n"
+			"Patterns are separated by spaces, and can use * ? and [] wildcards.");
+
 	// Object management knobs
 	Button(f, "activate_selection", "Activate sel.");
 	Tooltip(f, "Activate selected objects\n");
@@ -217,12 +378,21 @@ int ABCReadGeo::knob_changed(DD::Image::Knob* k)
 
 	if(k->name() == "Reload") {
 
+		releaseCachedArchive(filename());
 		knob("file")->changed();
 		return 1;
 	}
 
+	if(k->name() == "cancel_scan") {
+		if (m_scanPending) {
+			stopScan();
+			knob("scan_status")->label("Scan cancelled");
+			asapUpdate();
+		}
+		return 1;
+	}
+
 	if(k->name() == "Obj_list") {
-		m_rebuild_all = true;
 		return 1;
 	}
 
@@ -274,54 +444,170 @@ int ABCReadGeo::knob_changed(DD::Image::Knob* k)
 		return 1;
 	}
 
+	if(k->name() == "fps") {
+		// Setting it back to what the archive says goes back to following the archive
+		knob("fps_override")->set_value(m_archiveFps <= 0 || m_fps != m_archiveFps);
+	}
+
 	if(k->name() == "file") {
-		updateTableKnob();
-		updateTimingKnobs();
-		m_rebuild_all = true;
+		startScan(true);
+		return 1;
+	}
+
+	if(k->name() == "include" || k->name() == "exclude") {
+		// A scan in progress picks up the new patterns when it's done
+		if (!m_scanPending) {
+			startScan(false);
+		}
 		return 1;
 	}
 
+	updateScan();
+
 	return SourceGeo::knob_changed(k);
 }
 
 
+// *****************************************************************************
+// UPDATEUI : Fill in the object list once the background scan is done
+// *****************************************************************************
+
+bool ABCReadGeo::updateUI(const OutputContext& context)
+{
+	updateScan();
+	return SourceGeo::updateUI(context);
+}
+
+
+// *****************************************************************************
+// STARTSCAN : Walk the archive in the background, and update the knobs when done
+// *****************************************************************************
+
+void ABCReadGeo::startScan(bool timing)
+{
+	// Only the latest file is worth scanning
+	stopScan();
+
+	m_scanPending = true;
+	m_scanTiming = timing;
+
+	// Nothing to scan if the archive has been scanned already.
+	// If it's being scanned for another node, we wait for that scan too.
+	if (filename()[0] != '\0' && openArchive()) {
+		m_scan = startSceneIndexScan(archive);
+	}
+
+	// The old rows don't mean anything for the new file.
+	// While the scan runs, updateScan keeps asking for updateUI, which polls it.
+	if (!updateScan()) {
+		updateTableKnob();
+	}
+}
+
+
+// *****************************************************************************
+// UPDATESCAN : Show how the scan is going, and fill in the knobs when it's done
+// *****************************************************************************
+
+bool ABCReadGeo::updateScan()
+{
+	if (!m_scanPending) {
+		return false;
+	}
+
+	bool scanning = false;
+	size_t numVisited = 0;
+	SceneIndexPtr index;
+	if (filename()[0] != '\0' && archive.valid()) {
+		index = findSceneIndex(archive, &scanning, &numVisited);
+	}
+
+	if (!index && !scanning && filename()[0] != '\0' && archive.valid()) {
+		// The scan we waited for is gone (the archive was reopened, say). Start another one.
+		releaseSceneIndexScan(m_scan);
+		m_scan = startSceneIndexScan(archive);
+		index = findSceneIndex(archive, &scanning, &numVisited);
+	}
+
+	if (!index && scanning) {
+		std::ostringstream status;
+		status << "Scanning archive... " << numVisited << " objects";
+		knob("scan_status")->label(status.str().c_str());
+		asapUpdate();  // so updateUI comes back to check again
+		return false;
+	}
+
+	stopScan();
+
+	knob("scan_status")->label("");
+	updateTableKnob();
+	if (m_scanTiming) {
+		updateTimingKnobs();
+	}
+	return true;
+}
+
+
+// *****************************************************************************
+// STOPSCAN : Stop waiting for the background scan. It keeps going for other nodes.
+// *****************************************************************************
+
+void ABCReadGeo::stopScan()
+{
+	releaseSceneIndexScan(m_scan);
+	m_scan.reset();
+	m_scanPending = false;
+}
+
+
 // ***************************************************************************************
 // UPDATETABLEKNOB : Fill in the table knob with all geo objects from the ABC archive
 // ***************************************************************************************
 
 void ABCReadGeo::updateTableKnob()
 {
+	// Objects that are still listed (after a filter change, say) keep their Active and BBox settings
+	// (A table loaded with the script came from the index the current filter gives.)
+	std::map<std::string, std::pair<bool, bool> > rowStates;
+	SceneIndexPtr rowsIndex = m_tableIndex ? m_tableIndex : m_sceneIndex;
+	if (rowsIndex && p_tableKnobI->getRowCount() == int(rowsIndex->numGeos())) {
+		for (unsigned obj = 0; obj < rowsIndex->numGeos(); obj++) {
+			rowStates[rowsIndex->geo(obj).path] =
+					std::make_pair(p_tableKnobI->getCellBool(obj,1), p_tableKnobI->getCellBool(obj,2));
+		}
+	}
+
 	p_tableKnobI->suspendKnobChangedEvents();
 	p_tableKnobI->deleteAllItems();
 	p_tableKnobI->reset();
+	m_tableIndex.reset();
 
 	if (filename()[0] == '\0') {
 		p_tableKnobI->resumeKnobChangedEvents(true);
 		return;
 	}
 
-	IArchive archive( Alembic::AbcCoreHDF5::ReadArchive(),
-			filename(),
-			Abc::ErrorHandler::kQuietNoopPolicy );
-
-	if (!archive.valid()) {
+	if (!openArchive()) {
 		p_tableKnobI->resumeKnobChangedEvents(true);
 		return;
 	}
 
-	IObject archiveTop = archive.getTop();
-	std::vector<Alembic::AbcGeom::IObject> _objs;
-	getABCGeos(archiveTop, _objs);
-
+	updateSceneIndex();
 
-
-	int obj = 0;
-	for( std::vector<Alembic::AbcGeom::IObject>::const_iterator iObj( _objs.begin() ); iObj != _objs.end(); ++iObj ) {
+	for (unsigned obj = 0; m_sceneIndex && obj < m_sceneIndex->numGeos(); obj++) {
 		p_tableKnobI->addRow(obj);
-		p_tableKnobI->setCellString(obj,0,iObj->getName());
-		p_tableKnobI->setCellBool(obj,1,true);
-		obj++;
+		p_tableKnobI->setCellString(obj,0,m_sceneIndex->geo(obj).object.getName());
+
+		std::map<std::string, std::pair<bool, bool> >::const_iterator it = rowStates.find(m_sceneIndex->geo(obj).path);
+		if (it != rowStates.end()) {
+			p_tableKnobI->setCellBool(obj,1,it->second.first);
+			p_tableKnobI->setCellBool(obj,2,it->second.second);
+		}
+		else {
+			p_tableKnobI->setCellBool(obj,1,true);
+		}
 	}
+	m_tableIndex = m_sceneIndex;
 	p_tableKnobI->resumeKnobChangedEvents(true);
 }
 
@@ -336,22 +622,232 @@ void ABCReadGeo::updateTimingKnobs()
 		return;
 	}
 
-	IArchive archive( Alembic::AbcCoreHDF5::ReadArchive(),
-			filename(),
-			Abc::ErrorHandler::kQuietNoopPolicy );
+	if (!openArchive()) {
+		return;
+	}
+
+	// The scene index has the span already, so this doesn't walk the archive again
+	updateSceneIndex();
+	if (!m_fullSceneIndex) {
+		return;
+	}
+
+	chrono_t firstSample = m_fullSceneIndex->firstTime;
+	chrono_t lastSample = m_fullSceneIndex->lastTime;
+
+	// Leave the frame rate alone if the user has set it
+	double fps = m_fps > 0 ? m_fps : 24.0;
+	if (!m_fpsOverride) {
+		knob("archive_fps")->set_value(getABCFrameRate(archive, 24.0));
+		fps = m_archiveFps;
+		knob("fps")->set_value(fps);  // matches archive_fps, so it doesn't count as an override
+	}
+
+	knob("first")->set_value(int(firstSample * fps + 0.5f));
+	knob("last")->set_value(int(lastSample * fps + 0.5f));
+
+}
+
+
+// *****************************************************************************
+// OPENARCHIVE : Grab the shared archive for the current file
+// *****************************************************************************
+
+bool ABCReadGeo::openArchive()
+{
+	// The archive cache keeps a single open archive per file (and read options)
+	// for all nodes, and reopens it if the file changed on disk.
+	ArchiveReadOptions options;
+	options.numStreams = m_readStreams;
+	options.useMmap = m_useMmap;
+
+	archive = getCachedArchive(filename(), options);
+	return archive.valid();
+}
+
+
+// *****************************************************************************
+// UPDATESCENEINDEX : Grab the objects in the archive, and how they change over time
+// *****************************************************************************
+
+void ABCReadGeo::updateSceneIndex(bool wait)
+{
+	if (filename()[0] == '\0' || !openArchive()) {
+		m_fullSceneIndex.reset();
+		m_sceneIndex.reset();
+		return;
+	}
+
+	// The hierarchy is only walked once per archive, and shared with other nodes.
+	// Only the cook waits for it to be walked (or walks it, if nobody is).
+	if (!m_fullSceneIndex || m_fullSceneIndex->archive != archive.getPtr()) {
+		m_fullSceneIndex = wait ? getSceneIndex(archive) : findSceneIndex(archive);
+		m_sceneIndex.reset();
 
-	if (!archive.valid()) {
+		if (!m_fullSceneIndex) {
+			return;
+		}
+	}
+
+	// Objects that don't pass the path filter are left out of everything else
+	const std::string include = m_include ? m_include : "";
+	const std::string exclude = m_exclude ? m_exclude : "";
+	const std::string filter = include + "\n" + exclude;
+	if (!m_sceneIndex || filter != m_filter) {
+		m_sceneIndex = filterSceneIndex(m_fullSceneIndex, include, exclude);
+		m_filter = filter;
+	}
+}
+
+// *****************************************************************************
+// UPDATESAMPLETIMES : Look up the samples of every object at the current frame
+// *****************************************************************************
+
+void ABCReadGeo::updateSampleTimes()
+{
+	// Done here, before the cook threads start, so they can share the lookups
+	// without locking. Objects sharing a time sampling only look it up once.
+	m_sampleTimes.reset(getSampleTime(m_sampleFrame));
+
+	if (!m_sceneIndex) {
+		return;
+	}
+
+	for (unsigned i = 0; i < m_sceneIndex->objects.size(); i++) {
+		const SceneObject& obj = m_sceneIndex->objects[i];
+		if (!obj.constant) {
+			m_sampleTimes.add(obj.timeSampling, obj.numSamples);
+		}
+	}
+}
+
+// *****************************************************************************
+// UPDATEPREFETCH : Read the next frames in the background during playback
+// *****************************************************************************
+
+void ABCReadGeo::updatePrefetch()
+{
+	// Motion blur ops sample in between frames. Playback is tracked by the ones on frames.
+	double frame = outputContext().frame();
+	if (frame != floor(frame)) {
 		return;
 	}
 
-	chrono_t firstSample = std::numeric_limits<double>::max();
-	chrono_t lastSample = std::numeric_limits<double>::min();
+	// All the ops of this node share the prefetcher of the first one
+	static Lock prefetcherLock;
+	ABCReadGeo* first = static_cast<ABCReadGeo*>(firstOp());
+	SamplePrefetcher* prefetcher;
+	{
+		Guard guard(prefetcherLock);
+		if (!first->m_prefetcher && m_prefetch) {
+			first->m_prefetcher = new SamplePrefetcher;
+		}
+		prefetcher = first->m_prefetcher;
+	}
+
+	if (!prefetcher) {
+		return;
+	}
 
-	getABCTimeSpan(archive, firstSample, lastSample);
+	if (!m_prefetch || !m_sceneIndex) {
+		prefetcher->cancel();
+		return;
+	}
 
-	knob("first")->set_value(int(firstSample * _FPS + 0.5f));
-	knob("last")->set_value(int(lastSample * _FPS + 0.5f));
+	int direction = prefetcher->updateDirection(frame, m_sampleFrame);
+	if (direction == 0) {  // not playing back
+		prefetcher->cancel();
+		return;
+	}
 
+	// Only animated objects we're going to read are worth reading ahead
+	std::vector<Alembic::AbcGeom::IObject> objs;
+	for (unsigned i = 0; i < m_sceneIndex->numGeos() && i < active_objs.size(); i++) {
+		const SceneObject& geo = m_sceneIndex->geo(i);
+		if (active_objs[i] && !bbox_objs[i] && geo.pointsAnimated) {
+			objs.push_back(geo.object);
+		}
+	}
+
+	// Upcoming frames, going through the same clamping and retiming as the cook
+	std::vector<chrono_t> times;
+	float lastSampleFrame = m_sampleFrame;
+	for (int i = 1; i <= m_prefetchFrames; i++) {
+		float sampleFrame = getSampleFrame(frame + direction * i);
+		if (sampleFrame == lastSampleFrame)  // clamped, or held by the retime curve
+			continue;
+		times.push_back(getSampleTime(sampleFrame));
+		lastSampleFrame = sampleFrame;
+	}
+
+	if (objs.empty() || times.empty()) {
+		prefetcher->cancel();
+		return;
+	}
+
+	prefetcher->request(objs, times, interpolate != 0, interpolate == 2);
+}
+
+// *****************************************************************************
+// ISSTATIC : True if nothing about the active objects (or their parents) is animated
+// *****************************************************************************
+
+bool ABCReadGeo::isStatic() const
+{
+	if (!m_sceneIndex || m_sceneIndex->numGeos() < active_objs.size()) { // table out of sync with the archive
+		return false;
+	}
+
+	for (unsigned i = 0; i < active_objs.size(); i++) {
+		if (!active_objs[i])
+			continue;
+		const SceneObject& geo = m_sceneIndex->geo(i);
+		if (geo.pointsAnimated || geo.attributesAnimated || geo.topologyChanging) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+// *****************************************************************************
+// GETPOINTHASH : Hash of what the points of one object depend on at this frame
+// *****************************************************************************
+
+Hash ABCReadGeo::getPointHash(unsigned obj) const
+{
+	// Which object it is goes in too, so objects with the same flags and samples don't look alike
+	const SceneObject& geo = m_sceneIndex->geo(obj);
+
+	Hash hash;
+	hash.append(m_filename);
+	hash.append(geo.id);
+	hash.append(m_fps);
+	hash.append(interpolate);
+	hash.append(m_bakeXforms);
+	hash.append(active_objs[obj]);
+	hash.append(bbox_objs[obj]);
+
+	if (!active_objs[obj])
+		return hash;
+
+	// Deforming meshes depend on the keys of their position samples, which often
+	// stay the same over holds. Bboxes don't have keys, so they depend on the frame.
+	if (geo.topologyChanging || !geo.constant) {
+		if (bbox_objs[obj]) {
+			hash.append(m_sampleFrame);
+		}
+		else {
+			appendPointKeys(geo.object, getSampleTime(m_sampleFrame), interpolate != 0, interpolate == 2, hash, &m_sampleTimes);
+		}
+	}
+
+	if (m_bakeXforms && geo.parentAnimated) {
+		hash.append(m_sampleFrame);
+	}
+
+	return hash;
 }
 
 
@@ -367,8 +863,15 @@ void ABCReadGeo::append(Hash& hash)
 	p_tableKnobI = knob("Obj_list")->tableKnob();
 	Op::append(hash);
 
-	hash.append(outputContext().frame());
+	// The geometry only depends on the (clamped, retimed) frame we sample from,
+	// and not even on that if nothing we read is animated. That lets Nuke reuse
+	// its caches across frames for static archives and held frames.
+	updateSceneIndex();
+	if (!isStatic()) {
+		hash.append(getSampleFrame(outputContext().frame()));
+	}
 	hash.append(m_filename);
+	hash.append(m_filter.c_str());
 	hash.append(interpolate);
 
 	if (p_tableKnobI) {
@@ -379,6 +882,21 @@ void ABCReadGeo::append(Hash& hash)
 	}
 }
 
+struct PointHashJob
+{
+	const ABCReadGeo* op;
+	std::vector<Hash>* hashes;
+};
+
+static void computePointHashes(size_t begin, size_t end, void* d)
+{
+	PointHashJob* job = (PointHashJob*)d;
+
+	for (size_t i = begin; i < end; i++) {
+		(*job->hashes)[i] = job->op->getPointHash(i);
+	}
+}
+
 // *****************************************************************************
 // GET_GEOMETRY_HASH : Build up the geo hashes
 // *****************************************************************************
@@ -390,18 +908,86 @@ void ABCReadGeo::get_geometry_hash()
 
 	// Group Object
 	//geo_hash[Group_Object].append(m_filename);
+	// Points change when the samples they come from change, or when a parent moves
+	// if transforms are baked. Otherwise moving parents only change the object matrices.
+	// Table out of sync with the archive. Play safe.
+	bool outOfSync = !active_objs.empty() && (!m_sceneIndex || m_sceneIndex->numGeos() < active_objs.size());
+	bool xformsChanging = outOfSync;
+	m_newPointHashes.clear();
+	if (!outOfSync) {
+		// Each object reads the keys of its samples from the archive, so spread them over threads
+		m_newPointHashes.resize(active_objs.size());
+		PointHashJob job;
+		job.op = this;
+		job.hashes = &m_newPointHashes;
+		parallelFor(active_objs.size(), 16, std::max(m_threads, 0), computePointHashes, &job);
+
+		for (unsigned i = 0; i < active_objs.size(); i++) {
+			xformsChanging |= active_objs[i] && !m_bakeXforms && m_sceneIndex->geo(i).parentAnimated;
+		}
+	}
+
 	// Group Points
 	geo_hash[Group_Points].append(m_filename);
-	geo_hash[Group_Points].append(m_sampleFrame);
+	geo_hash[Group_Points].append(m_filter.c_str());
+	geo_hash[Group_Points].append(m_fps);
+	if (outOfSync) {
+		geo_hash[Group_Points].append(m_sampleFrame);
+	}
+	else {
+		for (unsigned i = 0; i < m_newPointHashes.size(); i++) {
+			geo_hash[Group_Points].append(m_newPointHashes[i].value());
+		}
+	}
 	geo_hash[Group_Points].append(interpolate);
+	geo_hash[Group_Points].append(m_bakeXforms);
+	geo_hash[Group_Points].append(m_primitiveType);  // rebuilding primitives throws the points away
+
+	// Group Matrix
+	geo_hash[Group_Matrix].append(m_filename);
+	geo_hash[Group_Matrix].append(m_filter.c_str());
+	geo_hash[Group_Matrix].append(m_fps);
+	if (xformsChanging) {
+		geo_hash[Group_Matrix].append(m_sampleFrame);
+	}
+	geo_hash[Group_Matrix].append(interpolate);
+	geo_hash[Group_Matrix].append(m_bakeXforms);
+
+	// Only objects with heterogeneous topology need their primitives rebuilt
+	// on every frame, and only those (or the ones with animated UVs/normals)
+	// need their attributes rebuilt. Bbox objects never do.
+	bool topoChanging = false;
+	bool attrsChanging = false;
+	for (unsigned i = 0; i < active_objs.size(); i++) {
+		if (!active_objs[i] || bbox_objs[i])
+			continue;
+
+		if (!m_sceneIndex || i >= m_sceneIndex->numGeos()) { // table out of sync with the archive. Play safe.
+			topoChanging = attrsChanging = true;
+			break;
+		}
+		topoChanging |= m_sceneIndex->geo(i).topologyChanging;
+		attrsChanging |= m_sceneIndex->geo(i).attributesAnimated;
+	}
 
 	// Group Primitives
 	geo_hash[Group_Primitives].append(m_filename);
-	geo_hash[Group_Primitives].append(m_sampleFrame);
+	geo_hash[Group_Primitives].append(m_filter.c_str());
+	geo_hash[Group_Primitives].append(m_fps);
+	geo_hash[Group_Primitives].append(m_primitiveType);
+	if (topoChanging) {
+		geo_hash[Group_Primitives].append(m_sampleFrame);
+	}
 
 	// Group Attributes
 	geo_hash[Group_Attributes].append(m_filename);
-	geo_hash[Group_Attributes].append(m_sampleFrame);
+	geo_hash[Group_Attributes].append(m_filter.c_str());
+	geo_hash[Group_Attributes].append(m_fps);
+	geo_hash[Group_Attributes].append(interpolate);  // normals are lerped too
+	geo_hash[Group_Attributes].append(m_primitiveType);  // and the attributes
+	if (attrsChanging) {
+		geo_hash[Group_Attributes].append(m_sampleFrame);
+	}
 
 	// Hash up Table knob selections
 	for (unsigned i = 0; i < active_objs.size(); i++) {
@@ -411,12 +997,50 @@ void ABCReadGeo::get_geometry_hash()
 		geo_hash[Group_Primitives].append(bbox_objs[i]);
 		geo_hash[Group_Points].append(bbox_objs[i]);
 		geo_hash[Group_Attributes].append(bbox_objs[i]);
+		geo_hash[Group_Matrix].append(active_objs[i]);
 	}
 
 }
 
 /*---------------------------------------------------------------------------------------------------*/
 
+// Everything the cook threads need to read a range of objects
+struct CookJob
+{
+	const SceneIndex* index;
+	std::vector<ObjectStage>* stages;
+	const std::vector<bool>* active;
+	const std::vector<bool>* bbox;
+	const std::vector<bool>* keepPoints;  // points already in the GeometryList are up to date
+	unsigned mask;
+	chrono_t curTime;
+	bool interpolate;
+	bool useVelocities;
+	unsigned numThreads;
+	XformCache* xformCache;
+	ConstantPointCache* constantPoints;
+	bool bakeXforms;
+};
+
+static void cookObjects(size_t begin, size_t end, void* d)
+{
+	CookJob* job = (CookJob*)d;
+
+	for (size_t i = begin; i < end; i++) {
+		if (i >= job->active->size() || !(*job->active)[i])
+			continue;
+
+		unsigned mask = job->mask;
+		if ((*job->keepPoints)[i]) {
+			mask &= ~Mask_Points;
+		}
+
+		stageObject(job->index->geo(i).object, (*job->stages)[i], mask,
+				(*job->bbox)[i], job->curTime, job->interpolate, job->numThreads, job->xformCache,
+				job->useVelocities, job->constantPoints, job->bakeXforms);
+	}
+}
+
 // *****************************************************************************
 // CREATE_GEOMETRY : The meat. Query the ABC archive for the needed bits
 // *****************************************************************************
@@ -432,43 +1056,84 @@ void ABCReadGeo::create_geometry(Scene& scene, GeometryList& out)
 
 
 
-	IArchive archive( Alembic::AbcCoreHDF5::ReadArchive(),
-			filename(),//archiveName,
-			Abc::ErrorHandler::kQuietNoopPolicy );
-
-	if (!archive.valid()) {
+	// Can't go on without knowing what's in the archive
+	updateSceneIndex(true);
+	if (!m_sceneIndex) {
 		std::cout << "error reading archive" << std::endl;
 		error("Unable to read file");
 		return;
 	}
 
-	IObject archiveTop = archive.getTop();
-
-	std::vector<Alembic::AbcGeom::IObject> _objs;
-
-	getABCGeos(archiveTop, _objs);
+	const SceneIndex& index = *m_sceneIndex;
+	const unsigned numGeos = index.numGeos();
 
 	// current Time to sample from
-	chrono_t curTime = m_sampleFrame / _FPS;
+	chrono_t curTime = getSampleTime(m_sampleFrame);
 
 
 	if ( rebuild(Mask_Primitives)) {
 		out.delete_objects();
 	}
 
-	int obj = 0;
-	for( std::vector<Alembic::AbcGeom::IObject>::const_iterator iObj( _objs.begin() ); iObj != _objs.end(); ++iObj ) {
+	unsigned mask = 0;
+	if ( rebuild(Mask_Primitives)) mask |= Mask_Primitives;
+	if ( rebuild(Mask_Points)) mask |= Mask_Points;
+	if ( rebuild(Mask_Attributes)) mask |= Mask_Attributes;
+
+	// Objects whose points hash didn't change keep the points they have
+	std::vector<bool> keepPoints(numGeos, false);
+	if (rebuild(Mask_Points) && !rebuild(Mask_Primitives) && m_newPointHashes.size() == numGeos) {
+		for (unsigned obj = 0; obj < numGeos && obj < m_pointHashes.size(); obj++) {
+			keepPoints[obj] = m_pointHashes[obj] == m_newPointHashes[obj];
+		}
+	}
+
+	// Read everything we need from the archive first. Objects don't depend on
+	// each other, so they can be read in parallel into their own stage...
+	std::vector<ObjectStage> stages(numGeos);
+
+	// Parent matrices are worked out once per cook, and shared by all objects.
+	// The xform samples they come from are kept on the first op, so the
+	// motion blur cooks around this frame only read and decompose them once.
+	XformSampleCache& xformSamples = static_cast<ABCReadGeo*>(firstOp())->m_xformSamples;
+	xformSamples.setArchive(archive.getPtr());
+	XformCache xformCache(index, curTime, interpolate != 0, &xformSamples, &m_sampleTimes);
+
+	// Same for the positions of meshes that don't deform
+	ConstantPointCache& constantPoints = static_cast<ABCReadGeo*>(firstOp())->m_constantPoints;
+	constantPoints.setArchive(archive.getPtr());
+
+	CookJob job;
+	job.index = &index;
+	job.stages = &stages;
+	job.active = &active_objs;
+	job.bbox = &bbox_objs;
+	job.keepPoints = &keepPoints;
+	job.mask = mask;
+	job.curTime = curTime;
+	job.interpolate = interpolate != 0;
+	job.useVelocities = interpolate == 2;
+	job.numThreads = std::max(m_threads, 0);
+	job.xformCache = &xformCache;
+	job.constantPoints = &constantPoints;
+	job.bakeXforms = m_bakeXforms;
+
+	parallelFor(numGeos, 1, job.numThreads, cookObjects, &job);
+
+	// ...and then copy the stages into the GeometryList, which has to happen serially
+	for (unsigned obj = 0; obj < numGeos; obj++) {
 
 		// Leave an empty obj if knob is unchecked
-		if (!active_objs[obj] ) {
+		if (obj >= active_objs.size() || !active_objs[obj] ) {
 			out.add_object(obj);
 			PointList& points = *out.writable_points(obj);
 			points.resize(0);
 			out[obj].delete_group_attribute(Group_Vertices,kUVAttrName, VECTOR4_ATTRIB);
-			obj++;
+			out[obj].delete_group_attribute(Group_Points,kUVAttrName, VECTOR4_ATTRIB);
 			continue;
 		}
 
+		const ObjectStage& stage = stages[obj];
 
 		if ( rebuild(Mask_Primitives)) {
 
@@ -477,33 +1142,21 @@ void ABCReadGeo::create_geometry(Scene& scene, GeometryList& out)
 				buildBboxPrimitives(out, obj);
 			}
 			else {
-				buildABCPrimitives(out, obj, *iObj, curTime);
+				buildABCPrimitives(out, obj, stage.faceCounts, stage.faceIndices, m_primitiveType == 1);
 			}
 		}
 
+		// Identity, unless transforms are left out of the points
+		out[obj].matrix = stage.matrix;
 
-
-		if ( rebuild(Mask_Points)) {
+		if ( rebuild(Mask_Points) && !keepPoints[obj]) {
 
 			PointList& points = *out.writable_points(obj);
 
-			if (bbox_objs[obj]) { //(bbox_mode) {
-				Imath::Box3d bbox = getBounds(*iObj, curTime);
-
-				points.resize(8);
-
-				IObject iObj_copy(*iObj);
-				Matrix4 xf = getConcatMatrix(iObj_copy,curTime, interpolate !=0); // for some reason getParent() won't take a const IObject, hence the copy...
-
-				// Add bbox corners
-				for (unsigned i = 0; i < 8; i++) {
-					Vector3 pt((i&4)>>2 ? bbox.max.x : bbox.min.x, (i&2)>>1 ? bbox.max.y : bbox.min.y, (i%2) ? bbox.max.z : bbox.min.z );
-					points[i] = xf.transform(pt);
-				}
-			}
-
-			else{
-				writePoints(*iObj, points, curTime, interpolate !=0);
+			unsigned numPoints = stage.points.size();
+			points.resize(numPoints);
+			for (unsigned i = 0; i < numPoints; i++) {
+				points[i] = stage.points[i];
 			}
 		}
 
@@ -513,26 +1166,42 @@ void ABCReadGeo::create_geometry(Scene& scene, GeometryList& out)
 
 			if (bbox_objs[obj]) { //(bbox_mode)
 				out[obj].delete_group_attribute(Group_Vertices,kUVAttrName, VECTOR4_ATTRIB);
+				out[obj].delete_group_attribute(Group_Points,kUVAttrName, VECTOR4_ATTRIB);
 			}
 			else {
-				// set UVs
-				Attribute* UV = out.writable_attribute(obj, Group_Vertices, kUVAttrName, VECTOR4_ATTRIB);
-				IV2fGeomParam uvParam = getUVsParam(*iObj);
-				setUVs(out[obj], uvParam, UV, curTime);
+				// set UVs. Per point UVs go to the points, and face-varying ones to the vertices
+				out[obj].delete_group_attribute(stage.uvsPerPoint ? Group_Vertices : Group_Points, kUVAttrName, VECTOR4_ATTRIB);
+				Attribute* UV = out.writable_attribute(obj, stage.uvsPerPoint ? Group_Points : Group_Vertices, kUVAttrName, VECTOR4_ATTRIB);
+				if (stage.hasUVs) {
+					UV->resize(stage.uvs.size());
+					for (unsigned i = 0; i < stage.uvs.size(); i++) {
+						UV->vector4(i) = stage.uvs[i];
+					}
+				}
 
 				// set Normals
-				IN3fGeomParam nParam = getNsParam(*iObj);
-				if (nParam.valid()) {
-					Attribute* N = out.writable_attribute(obj, Group_Vertices, kNormalAttrName, NORMAL_ATTRIB);
-					setNormals(out[obj], nParam, N, curTime);
+				if (stage.hasNormalsParam) {
+					out[obj].delete_group_attribute(stage.normalsPerPoint ? Group_Vertices : Group_Points, kNormalAttrName, NORMAL_ATTRIB);
+					Attribute* N = out.writable_attribute(obj, stage.normalsPerPoint ? Group_Points : Group_Vertices, kNormalAttrName, NORMAL_ATTRIB);
+					if (stage.hasNormals) {
+						N->resize(stage.normals.size());
+						for (unsigned i = 0; i < stage.normals.size(); i++) {
+							N->normal(i) = stage.normals[i];
+						}
+					}
 				}
 			}
 		}
+	}
 
-		obj++;
+	// Remember what the points we just wrote came from
+	if (rebuild(Mask_Points) && m_newPointHashes.size() == numGeos) {
+		m_pointHashes = m_newPointHashes;
+	}
+	else if (rebuild(Mask_Points) || rebuild(Mask_Primitives)) {
+		m_pointHashes.clear();
 	}
 
-	m_rebuild_all = false;
 	out.synchronize_objects();
 
 